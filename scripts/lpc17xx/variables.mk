@@ -5,6 +5,10 @@ ASMSRC = lpc17xx/pseudoboot.S lpc17xx/startup.S lpc17xx/crc.S
 
 SRC += lpc17xx/fastloader-ll.c lpc17xx/iec-bus.c
 
+ifeq ($(CONFIG_IEC_ENGINE),y)
+  SRC += lpc17xx/iec-ll.c
+endif
+
 ifeq ($(CONFIG_UART_DEBUG),y)
   SRC += lpc17xx/printf.c
 endif
@@ -1371,6 +1371,11 @@ static inline uint8_t display_intrq_active(void) {
 #  define P00CACHE_ATTRIB
 #endif
 
+/* Dxx track cache is in bss by default */
+#ifndef TRACKCACHE_ATTRIB
+#  define TRACKCACHE_ATTRIB
+#endif
+
 /* -- ensure that the timing for Dolphin is achievable        -- */
 /* the C64 will switch to an alternate, not-implemented protocol */
 /* if the answer to the XQ/XZ commands is too late and the       */
@@ -29,6 +29,7 @@
 #include "errormsg.h"
 #include "ff.h"
 #include "led.h"
+#include "d64ops.h"
 #include "buffers.h"
 
 dh_t    matchdh;
@@ -37,12 +38,69 @@ uint8_t entrybuf[33];
 /// One additional buffer structure for channel 15
 buffer_t buffers[CONFIG_BUFFER_COUNT+1];
 
+#ifdef CONFIG_RAM_POOL
+#  ifndef RAM_POOL_START
+#    error "CONFIG_RAM_POOL is not supported on this architecture!"
+#  endif
+
+/// Split of the RAM pool, see pool_init
+poolsplit_t pool_split;
+
+/// The actual data buffers, placed in the RAM pool
+static uint8_t *bufferdata;
+#else
 /// The actual data buffers
 static uint8_t bufferdata[CONFIG_BUFFER_COUNT*256];
+#endif
+
+#ifdef CONFIG_SPARE_BUFFERS
+#  if CONFIG_SPARE_BUFFERS < 1 || CONFIG_SPARE_BUFFERS > 8
+#    error "CONFIG_SPARE_BUFFERS must be between 1 and 8!"
+#  endif
+
+#  ifdef CONFIG_RAM_POOL
+/// Second data areas for double-buffered channels, placed in the RAM pool
+static uint8_t *sparedata;
+#    define spare_count pool_split.spares
+#  else
+/// Second data areas for double-buffered channels
+static uint8_t sparedata[CONFIG_SPARE_BUFFERS*256];
+#    define spare_count CONFIG_SPARE_BUFFERS
+#  endif
+
+/// Bitmap of the second data areas in use
+static uint8_t spareused;
+#endif
 
 /// Number of active data buffers + 16 * number of dirty buffers
 uint8_t active_buffers;
 
+/// Channel table: index of the buffer for secondary addresses 0-15 and
+/// the special-purpose buffers, 255 if there is none
+#define CHANNEL_SLOTS (16 + BUFFER_SYS_PREFETCH - BUFFER_SEC_SYSTEM)
+static uint8_t channels[CHANNEL_SLOTS];
+
+/// Stack of the indices of unallocated buffers
+static uint8_t freebuffers[CONFIG_BUFFER_COUNT];
+static uint8_t freecount;
+
+/**
+ * channel_slot - get the channel table slot for a secondary address
+ * @secondary: secondary address or BUFFER_SYS_* id
+ *
+ * Returns the index into the channel table for @secondary or 255 if
+ * buffers with this secondary address are not tracked in the table.
+ */
+static uint8_t channel_slot(uint8_t secondary) {
+  if (secondary < 16)
+    return secondary;
+
+  if (secondary > BUFFER_SEC_SYSTEM && secondary <= BUFFER_SYS_PREFETCH)
+    return secondary - BUFFER_SEC_SYSTEM + 15;
+
+  return 255;
+}
+
 /**
  * callback_dummy - dummy function for the buffer callbacks
  * @buf: pointer to a buffer
@@ -55,6 +113,67 @@ uint8_t callback_dummy(buffer_t *buf) {
   return 0;
 }
 
+#ifdef CONFIG_RAM_POOL
+/**
+ * pool_init - split the RAM pool
+ *
+ * This function divides the RAM pool into 256-byte blocks for the
+ * buffer data areas, the second data areas and the track cache.
+ * The buffers get up to CONFIG_BUFFER_COUNT blocks, but at least one
+ * block is left for the track cache. The track cache is guaranteed
+ * CONFIG_TRACK_CACHE_SIZE before the second data areas get up to
+ * CONFIG_SPARE_BUFFERS blocks, the rest of the pool is added to the
+ * track cache.
+ */
+static void pool_init(void) {
+  uint8_t *ptr  = (uint8_t *)(((uintptr_t)RAM_POOL_START + 3) & ~3UL);
+  uint16_t left = 0;
+#ifdef CONFIG_TRACK_CACHE
+  uint16_t reserve;
+#endif
+
+  if (ptr < RAM_POOL_END)
+    left = (RAM_POOL_END - ptr) / 256;
+
+  pool_split.buffers = CONFIG_BUFFER_COUNT;
+#ifdef CONFIG_TRACK_CACHE
+  if (pool_split.buffers >= left)
+    pool_split.buffers = (left ? left - 1 : 0);
+#else
+  if (pool_split.buffers > left)
+    pool_split.buffers = left;
+#endif
+  left -= pool_split.buffers;
+  bufferdata = ptr;
+  ptr += 256 * pool_split.buffers;
+
+#ifdef CONFIG_TRACK_CACHE
+  reserve = CONFIG_TRACK_CACHE_SIZE / 256;
+  if (reserve > left)
+    reserve = left;
+  left -= reserve;
+#endif
+
+#ifdef CONFIG_SPARE_BUFFERS
+  pool_split.spares = CONFIG_SPARE_BUFFERS;
+  if (pool_split.spares > left)
+    pool_split.spares = left;
+  left -= pool_split.spares;
+  sparedata = ptr;
+  ptr += 256 * pool_split.spares;
+#endif
+
+#ifdef CONFIG_TRACK_CACHE
+  left += reserve;
+  pool_split.cache = (left > 255 ? 255 : left);
+  left -= pool_split.cache;
+  d64_trackcache_setup(ptr, pool_split.cache);
+#endif
+
+  pool_split.unused = (left > 255 ? 255 : left);
+}
+#endif
+
 /**
  * buffers_init - initializes the buffer data structures
  *
@@ -63,9 +182,22 @@ uint8_t callback_dummy(buffer_t *buf) {
 void buffers_init(void) {
   uint8_t i;
 
+#ifdef CONFIG_RAM_POOL
+  pool_init();
+#endif
+
   memset(buffers,0,sizeof(buffers));
-  for (i=0;i<CONFIG_BUFFER_COUNT;i++)
+  for (i=0;i<buffer_count;i++) {
     buffers[i].data = bufferdata + 256*i;
+    freebuffers[i]  = buffer_count-1 - i;
+  }
+  freecount = buffer_count;
+#ifdef CONFIG_SPARE_BUFFERS
+  spareused = 0;
+#endif
+
+  memset(channels, 255, sizeof(channels));
+  channels[15] = CONFIG_BUFFER_COUNT;
 
   buffers[CONFIG_BUFFER_COUNT].data      = error_buffer;
   buffers[CONFIG_BUFFER_COUNT].secondary = 15;
@@ -81,33 +213,58 @@ void buffers_init(void) {
  * alloc_specific_buffer - allocate a specific buffer for system use
  *
  * This function allocates the specified buffer and marks it as used.
- * Returns without doing anything if the buffer is already allocated.
+ * The buffer must already be removed from the free buffer stack.
  */
 static void alloc_specific_buffer(uint8_t bufnum) {
-  if (!buffers[bufnum].allocated) {
-    /* Clear everything except the data pointer */
-    memset(sizeof(uint8_t *)+(char *)&(buffers[bufnum]),0,sizeof(buffer_t)-sizeof(uint8_t *));
-    buffers[bufnum].allocated = 1;
-    buffers[bufnum].secondary = BUFFER_SEC_SYSTEM;
-    buffers[bufnum].refill    = callback_dummy;
-    buffers[bufnum].cleanup   = callback_dummy;
-  }
+  /* Clear everything except the data pointer */
+  memset(sizeof(uint8_t *)+(char *)&(buffers[bufnum]),0,sizeof(buffer_t)-sizeof(uint8_t *));
+  buffers[bufnum].allocated = 1;
+  buffers[bufnum].secondary = BUFFER_SEC_SYSTEM;
+  buffers[bufnum].refill    = callback_dummy;
+  buffers[bufnum].cleanup   = callback_dummy;
 }
 
+#ifdef CONFIG_CHAIN_PREFETCH
+/**
+ * reclaim_prefetch - free the prefetch buffer of d64ops
+ *
+ * This function frees the buffer that holds the prefetched sector of a
+ * disk image, its contents are optional. Returns 1 if a buffer was
+ * freed, 0 if there was none.
+ */
+static uint8_t reclaim_prefetch(void) {
+  buffer_t *buf = find_buffer(BUFFER_SYS_PREFETCH);
+
+  if (buf == NULL)
+    return 0;
+
+  cleanup_and_free_buffer(buf);
+  return 1;
+}
+#else
+static inline uint8_t reclaim_prefetch(void) {
+  return 0;
+}
+#endif
+
 /**
  * alloc_system_buffer - allocate a buffer for system use
  *
  * This function allocates a buffer and marks it as used. Returns a
  * pointer to the buffer structure or NULL of no buffer is free.
+ * The prefetch buffer of d64ops is taken over if it is the
+ * only buffer left.
  */
 buffer_t *alloc_system_buffer(void) {
   uint8_t i;
 
-  for (i=0;i<CONFIG_BUFFER_COUNT;i++) {
-    if (!buffers[i].allocated) {
-      alloc_specific_buffer(i);
-      return &buffers[i];
-    }
+  if (freecount == 0)
+    reclaim_prefetch();
+
+  if (freecount != 0) {
+    i = freebuffers[--freecount];
+    alloc_specific_buffer(i);
+    return &buffers[i];
   }
 
   set_error(ERROR_NO_CHANNEL);
@@ -139,14 +296,16 @@ buffer_t *alloc_buffer(void) {
  * links them. It will also turn on the busy LED to notify the user.
  * Returns a pointer to the first buffer structure or NULL if
  * not enough buffers are free. The data segments of the allocated
- * buffers are guaranteed to be continuous.
+ * buffers are guaranteed to be continuous. The prefetch buffer of
+ * d64ops is freed if it is in the way.
  */
 buffer_t *alloc_linked_buffers(uint8_t count) {
   uint8_t i,freebufs,start;
 
+ retry:
   freebufs = 0;
   start    = 0;
-  for (i=0;i<CONFIG_BUFFER_COUNT;i++) {
+  for (i=0;i<buffer_count;i++) {
     if (buffers[i].allocated) {
       /* Look for continuous buffers */
       /* Switching data segments is possible, but probably not required */
@@ -162,10 +321,21 @@ buffer_t *alloc_linked_buffers(uint8_t count) {
   }
 
   if (freebufs < count) {
+    /* The prefetch buffer may be in the way */
+    if (reclaim_prefetch())
+      goto retry;
+
     set_error(ERROR_NO_CHANNEL);
     return NULL;
   }
 
+  /* Take them off the free buffer stack */
+  for (i=0,freebufs=0;i<freecount;i++) {
+    if (freebuffers[i] < start || freebuffers[i] >= start+count)
+      freebuffers[freebufs++] = freebuffers[i];
+  }
+  freecount = freebufs;
+
   /* Chain the buffers */
   for (i=0;i<count;i++) {
     alloc_specific_buffer(start+i);
@@ -205,12 +375,34 @@ void cleanup_and_free_buffer(buffer_t *buffer) {
  * buffers.
  */
 void free_buffer(buffer_t *buffer) {
+  uint8_t slot;
+
   if (buffer == NULL) return;
   if (buffer->secondary == 15) return;
   if (!buffer->allocated) return;
 
   buffer->allocated = 0;
 
+  slot = channel_slot(buffer->secondary);
+  if (slot != 255 && channels[slot] == buffer - buffers)
+    channels[slot] = 255;
+
+  freebuffers[freecount++] = buffer - buffers;
+
+#ifdef CONFIG_SPARE_BUFFERS
+  if (buffer->spare != NULL) {
+    /* Return the second data area, the buffer may hold either one */
+    uint8_t *own = bufferdata + 256 * (buffer - buffers);
+
+    if (buffer->data != own) {
+      buffer->spare = buffer->data;
+      buffer->data  = own;
+    }
+    spareused &= ~(1 << ((buffer->spare - sparedata) / 256));
+    buffer->spare = NULL;
+  }
+#endif
+
   if (buffer->dirty)
     active_buffers -= 16;
   if (buffer->secondary < BUFFER_SEC_SYSTEM)
@@ -251,22 +443,95 @@ uint8_t free_multiple_buffers(uint8_t flags) {
   return res;
 }
 
+#ifdef CONFIG_SPARE_BUFFERS
+/**
+ * alloc_spare - give a buffer a second data area
+ * @buf    : pointer to the buffer
+ * @service: callback that fills or writes the second area while idle
+ *
+ * This function assigns one of the second data areas to @buf, which
+ * allows the owner of the buffer to prepare the next block in one area
+ * while the bus transfers the other. The area is returned to the pool
+ * when the buffer is freed. Returns 0 if successful or 1 if all areas
+ * are in use; this is not an error, the buffer just works without a
+ * second area.
+ */
+uint8_t alloc_spare(buffer_t *buf, uint8_t (*service)(buffer_t *buf)) {
+  uint8_t i;
+
+  for (i=0;i<spare_count;i++) {
+    if (!(spareused & (1 << i))) {
+      spareused      |= 1 << i;
+      buf->spare      = sparedata + 256*i;
+      buf->sparestate = SPARE_EMPTY;
+      buf->service    = service;
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * spare_service - service the second data areas
+ *
+ * This function calls the service callback of every buffer with a
+ * second data area. It is called by the bus layer while the bus is
+ * idle and once per block of a standard transfer. The callbacks must
+ * not free a buffer, its owner may still be using it.
+ */
+void spare_service(void) {
+  uint8_t i;
+
+  if (spareused == 0)
+    return;
+
+  for (i=0;i<CONFIG_BUFFER_COUNT;i++)
+    if (buffers[i].allocated && buffers[i].spare != NULL)
+      buffers[i].service(&buffers[i]);
+}
+#endif
+
+/**
+ * set_buffer_secondary - assign a secondary address to a buffer
+ * @buf      : pointer to the buffer
+ * @secondary: secondary address or BUFFER_SYS_* id
+ *
+ * This function sets the secondary address of @buf and updates the
+ * channel table, so find_buffer returns @buf for @secondary and no
+ * longer for its previous secondary address. The buffers of a chain
+ * that are not active use BUFFER_SEC_CHAIN-secondary, which is not
+ * tracked in the table.
+ */
+void set_buffer_secondary(buffer_t *buf, uint8_t secondary) {
+  uint8_t index = buf - buffers;
+  uint8_t slot  = channel_slot(buf->secondary);
+
+  if (slot != 255 && channels[slot] == index)
+    channels[slot] = 255;
+
+  buf->secondary = secondary;
+
+  slot = channel_slot(secondary);
+  if (slot != 255)
+    channels[slot] = index;
+}
+
 /**
  * find_buffer - find the buffer corresponding to a secondary address
  * @secondary: secondary address to look for
  *
- * This function returns a pointer to the first buffer structure whose
- * secondary address is the same as the one given. Returns NULL if
- * no matching buffer was found.
+ * This function returns a pointer to the buffer structure that was
+ * last assigned the given secondary address with set_buffer_secondary.
+ * Returns NULL if no matching buffer was found.
  */
 buffer_t *find_buffer(uint8_t secondary) {
-  uint8_t i;
+  uint8_t slot = channel_slot(secondary);
 
-  for (i=0;i<CONFIG_BUFFER_COUNT+1;i++) {
-    if (buffers[i].allocated && buffers[i].secondary == secondary)
-      return &buffers[i];
-  }
-  return NULL;
+  if (slot == 255 || channels[slot] == 255)
+    return NULL;
+
+  return &buffers[channels[slot]];
 }
 
 /**
@@ -30,9 +30,13 @@
 
 #define BUFFER_SEC_SYSTEM 100
 
-/* Special-purpose buffer numbers */
+/* Special-purpose buffer numbers, the channel table in buffers.c */
+/* covers the range up to BUFFER_SYS_PREFETCH                      */
 #define BUFFER_SYS_BAM     (BUFFER_SEC_SYSTEM+1)
 #define BUFFER_SYS_GEOSKEY (BUFFER_SEC_SYSTEM+2)
+#define BUFFER_SYS_PREFETCH (BUFFER_SEC_SYSTEM+3)
+/* holds an image file handle, see handle_alloc in fatops.c */
+#define BUFFER_SYS_HANDLE  (BUFFER_SEC_SYSTEM+4)
 /* chained buffers use (BUFFER_SEC_CHAIN-14)..BUFFER_SEC_CHAIN */
 /* to distinguish secondary addresses */
 #define BUFFER_SEC_CHAIN   (BUFFER_SEC_SYSTEM-1)
@@ -48,6 +52,12 @@
 #define FMB_UNSTICKY       (FMB_FREE_SYSTEM)
 #define FMB_UNSTICKY_CLEAN (FMB_FREE_SYSTEM|FMB_CLEAN)
 
+/* States of the second data area of a buffer */
+#define SPARE_EMPTY        0  /* unused */
+#define SPARE_FULL         1  /* holds the next block to be read     */
+#define SPARE_PENDING      2  /* holds a block that must be written  */
+#define SPARE_FAILED       3  /* writing it failed, sparelast: error */
+
 typedef enum { DIR_FMT_CBM, DIR_FMT_CMD_SHORT, DIR_FMT_CMD_LONG } dirformat_t;
 
 /**
@@ -65,10 +75,18 @@ typedef enum { DIR_FMT_CBM, DIR_FMT_CMD_SHORT, DIR_FMT_CMD_LONG } dirformat_t;
  * @sticky   : Flags if the buffer will survive garbage collection
  * @refill   : Callback to refill/write out the buffer, returns true on error
  * @cleanup  : Callback to clean up and save remaining data, returns true on error
+ * @spare    : Second data area of the buffer, NULL if it has none
+ * @sparestate: SPARE_* state of the second data area
+ * @sparelast: lastused of the block in the second data area
+ * @spareeoi : sendeoi of the block in the second data area
+ * @sparefptr: fptr of the block in the second data area
+ * @service  : Callback to fill or write the second data area while the
+ *             bus is idle, returns true on error
  *
  * Most allocated buffers point into the same bufferdata array, but
  * the error channel uses the same structure to avoid special-casing it
- * everywhere.
+ * everywhere. A buffer with a second data area swaps data and spare
+ * at block boundaries, so data may point into the spare pool as well.
  */
 typedef struct buffer_s {
   /* The error channel uses the same data structure for convenience reasons, */
@@ -91,16 +109,24 @@ typedef struct buffer_s {
   uint8_t (*seek) (struct buffer_s *buffer, uint32_t position, uint8_t index);
   uint8_t (*refill)(struct buffer_s *buffer);
   uint8_t (*cleanup)(struct buffer_s *buffer);
+#ifdef CONFIG_SPARE_BUFFERS
+  uint8_t *spare;
+  uint8_t sparestate;
+  uint8_t sparelast;
+  uint8_t spareeoi;
+  uint32_t sparefptr;
+  uint8_t (*service)(struct buffer_s *buffer);
+#endif
 
   /* private: */
   union {
     struct {
       dh_t dh;             /* Directory handle */
-      uint8_t filetype;    /* File type */
-      dirformat_t format;  /* Dir format */
       uint8_t *matchstr;   /* Pointer to filename pattern */
       date_t *match_start; /* Start matching date */
       date_t *match_end;   /* End matching date */
+      uint8_t filetype;    /* File type */
+      uint8_t format;      /* Dir format (dirformat_t) */
       uint8_t counter;     /* used for counting raw entries */
     } dir;
     struct {
@@ -159,6 +185,9 @@ uint8_t free_multiple_buffers(uint8_t flags);
 /* Smaller than a #define for some reason: */
 static void inline stick_buffer(buffer_t *buf) { buf->sticky = 1; }
 
+/* Assigns a secondary address to a buffer */
+void set_buffer_secondary(buffer_t *buf, uint8_t secondary);
+
 /* Finds the buffer corresponding to a secondary address */
 /* Returns pointer to buffer on success or NULL on failure */
 buffer_t *find_buffer(uint8_t secondary);
@@ -166,8 +195,25 @@ buffer_t *find_buffer(uint8_t secondary);
 /* Number of currently allocated buffers + 16 * number of write buffers */
 extern uint8_t active_buffers;
 
+#ifdef CONFIG_RAM_POOL
+/* Number of 256-byte blocks of the RAM pool used for each purpose */
+typedef struct {
+  uint8_t buffers;  /* buffer data areas */
+  uint8_t spares;   /* second data areas */
+  uint8_t cache;    /* track cache       */
+  uint8_t unused;
+} poolsplit_t;
+
+extern poolsplit_t pool_split;
+
+/* Number of buffers that have a data area */
+#  define buffer_count pool_split.buffers
+#else
+#  define buffer_count CONFIG_BUFFER_COUNT
+#endif
+
 /* Check if any buffers are free */
-#define check_free_buffers() ((active_buffers & 0x0f) < CONFIG_BUFFER_COUNT)
+#define check_free_buffers() ((active_buffers & 0x0f) < buffer_count)
 
 /* Return the number of dirty buffers */
 #define get_dirty_buffer_count() (active_buffers >> 4)
@@ -177,6 +223,23 @@ static inline void mark_write_buffer(buffer_t *buf) {
   buf->write = 1;
 }
 
+#ifdef CONFIG_SPARE_BUFFERS
+/* Gives a buffer a second data area - returns 0 on success, 1 if none is free */
+uint8_t alloc_spare(buffer_t *buf, uint8_t (*service)(buffer_t *buf));
+
+/* Exchanges the two data areas of a buffer */
+static inline void swap_spare(buffer_t *buf) {
+  uint8_t *tmp = buf->data;
+  buf->data  = buf->spare;
+  buf->spare = tmp;
+}
+
+/* Fills or writes the second data areas, called between bus transfers */
+void spare_service(void);
+#else
+#  define spare_service() do {} while (0)
+#endif
+
 /* Mark a buffer as dirty */
 void mark_buffer_dirty(buffer_t *buf);
 
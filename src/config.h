@@ -35,6 +35,11 @@
 #  undef CONFIG_COMMAND_CHANNEL_DUMP
 #endif
 
+/* The track cache already holds the next sector of a chain */
+#ifdef CONFIG_TRACK_CACHE
+#  undef CONFIG_CHAIN_PREFETCH
+#endif
+
 /* An interrupt for detecting card changes implies hotplugging capability */
 #if defined(SD_CHANGE_HANDLER) || defined (CF_CHANGE_HANDLER)
 #  define HAVE_HOTPLUG
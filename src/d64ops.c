@@ -31,9 +31,11 @@
 #include "errormsg.h"
 #include "fatops.h"
 #include "ff.h"
+#include "flags.h"
 #include "parser.h"
 #include "progmem.h"
 #include "rtc.h"
+#include "timer.h"
 #include "ustring.h"
 #include "wrapops.h"
 #include "d64ops.h"
@@ -77,9 +79,73 @@
 #define DNP_LABEL_AREA_SIZE             (28-4+1)
 #define DNP_ID_OFFSET                    22
 
+/* REL file side sectors */
+#define SS_OFS_NUMBER                     2
+#define SS_OFS_RECORDLEN                  3
+#define SS_OFS_GROUP                      4
+#define SS_OFS_DATA                      16
+#define SS_BLOCKS                       120  // data blocks per side sector
+#define SS_PER_GROUP                      6  // side sectors per group
+#define SSS_MARKER                     0xfe
+#define SSS_OFS_GROUPS                    3
+#define SSS_GROUPS                      126  // groups per super side sector
+
 /* used for error info only */
 #define MAX_SECTORS_PER_TRACK 40
 
+#ifdef CONFIG_TRACK_CACHE
+#  if CONFIG_TRACK_CACHE_SIZE < 256 || CONFIG_TRACK_CACHE_SIZE / 256 > 255
+#    error "CONFIG_TRACK_CACHE_SIZE must be between 256 and 65280 bytes!"
+#  endif
+
+#  ifdef CONFIG_RAM_POOL
+/* number of sectors that fit into the track cache, set at boot */
+#    define TRACKCACHE_SECTORS trackcache_sectors
+#  else
+/* number of sectors that fit into the track cache */
+#    define TRACKCACHE_SECTORS (CONFIG_TRACK_CACHE_SIZE / 256)
+#  endif
+#endif
+
+#ifdef CONFIG_DIR_INDEX
+/* number of directory sectors that fit into the name index */
+#  define DIRINDEX_SECTORS ((CONFIG_DIR_INDEX_SIZE + 7) / 8)
+
+#  if DIRINDEX_SECTORS < 1 || DIRINDEX_SECTORS > 255
+#    error "CONFIG_DIR_INDEX_SIZE must be between 1 and 2040 entries!"
+#  endif
+#endif
+
+#ifdef CONFIG_SEEK_INDEX
+#  if CONFIG_SEEK_INDEX_SIZE < 2 || CONFIG_SEEK_INDEX_SIZE > 1024 || \
+     (CONFIG_SEEK_INDEX_SIZE & 1)
+#    error "CONFIG_SEEK_INDEX_SIZE must be an even number between 2 and 1024!"
+#  endif
+#endif
+
+#ifdef CONFIG_IMAGE_SYNC_SECTORS
+#  if CONFIG_IMAGE_SYNC_SECTORS < 1 || CONFIG_IMAGE_SYNC_SECTORS > 255
+#    error "CONFIG_IMAGE_SYNC_SECTORS must be between 1 and 255!"
+#  endif
+#endif
+
+#if defined(CONFIG_READ_BENCHMARK) && !defined(HAVE_CYCLE_COUNTER)
+#  error "CONFIG_READ_BENCHMARK requires a CPU cycle counter!"
+#endif
+
+#if defined(CONFIG_VALIDATE) && !defined(CONFIG_TRACK_CACHE)
+#  error "CONFIG_VALIDATE requires CONFIG_TRACK_CACHE!"
+#endif
+
+/* maximum nesting depth of DNP subdirectories for validate */
+#define VALIDATE_MAX_DEPTH 16
+
+#ifdef CONFIG_MOUNT_CACHE
+#  if CONFIG_MOUNT_CACHE < 1 || CONFIG_MOUNT_CACHE > 16
+#    error "CONFIG_MOUNT_CACHE must be between 1 and 16!"
+#  endif
+#endif
+
 typedef enum { BAM_BITFIELD, BAM_FREECOUNT } bamdata_t;
 
 struct {
@@ -88,6 +154,94 @@ struct {
   uint8_t errors[MAX_SECTORS_PER_TRACK];
 } errorcache;
 
+#ifdef CONFIG_TRACK_CACHE
+static struct {
+  uint8_t  part;     /* partition of the cached data, 255 if invalid */
+  uint16_t first;    /* LBA of the first cached sector */
+  uint8_t  count;    /* number of cached sectors */
+} trackcache;
+
+#  ifdef CONFIG_RAM_POOL
+/* placed in the RAM pool by buffers_init */
+static uint8_t *trackcache_data;
+static uint8_t  trackcache_sectors;
+#  else
+static TRACKCACHE_ATTRIB uint8_t trackcache_data[TRACKCACHE_SECTORS * 256];
+#  endif
+#endif
+
+#ifdef CONFIG_CHAIN_PREFETCH
+static struct {
+  buffer_t *buf;     /* buffer holding the prefetched sector, NULL if none */
+  uint8_t   part;
+  uint8_t   track;
+  uint8_t   sector;
+  uint8_t   valid;   /* 0 while the read is still pending */
+} prefetch;
+#endif
+
+#ifdef CONFIG_DIR_CACHE
+static struct {
+  uint8_t part;      /* partition of the cached sector, 255 if invalid */
+  uint8_t track;
+  uint8_t sector;
+#  ifdef CONFIG_SCRATCH_BATCH
+  uint8_t dirty;     /* changed by a batched scratch, not yet written */
+#  endif
+  uint8_t data[256];
+} dircache;
+
+#  ifdef CONFIG_SCRATCH_BATCH
+#    define dircache_dirty() dircache.dirty
+#  else
+#    define dircache_dirty() 0
+#  endif
+#endif
+
+#ifdef CONFIG_DIR_INDEX
+static struct {
+  uint8_t part;      /* partition of the indexed directory, 255 if invalid */
+  uint8_t sectors;   /* number of indexed directory sectors */
+  uint8_t ts[DIRINDEX_SECTORS][2];     /* track/sector of each dir sector */
+  uint8_t hash[DIRINDEX_SECTORS * 8];  /* name hash per entry, 0 if empty */
+} dirindex;
+#endif
+
+#ifdef CONFIG_SEEK_INDEX
+static struct {
+  uint8_t  part;     /* partition of the indexed file, 255 if invalid */
+  uint8_t  track;    /* first sector of the indexed file */
+  uint8_t  sector;
+  uint8_t  shift;    /* each entry covers 1 << shift blocks */
+  uint16_t count;    /* number of valid entries */
+  uint8_t  ts[CONFIG_SEEK_INDEX_SIZE][2]; /* track/sector of every covered block */
+} seekindex;
+#endif
+
+#ifdef CONFIG_IMAGE_SYNC_SECTORS
+static struct {
+  uint8_t part;      /* partition with unsynced writes, 255 if none */
+  uint8_t count;     /* number of writes that asked for a sync */
+} imagesync;
+#endif
+
+#ifdef CONFIG_MOUNT_CACHE
+static struct {
+  uint8_t part;      /* partition of the image file, 255 if unused */
+  uint8_t stamp;     /* value of mountstamp when the entry was stored */
+  DWORD   cluster;   /* start cluster of the image file */
+  DWORD   fsize;     /* size of the image file */
+  uint8_t bam_ts[2]; /* track/sector of the saved BAM sector, 0/0 if none */
+  uint8_t bam[256];
+#  ifdef CONFIG_DIR_CACHE
+  uint8_t dir_ts[2]; /* track/sector of the saved dir sector, 0/0 if none */
+  uint8_t dir[256];
+#  endif
+} mountcache[CONFIG_MOUNT_CACHE];
+
+static uint8_t mountstamp;
+#endif
+
 static buffer_t *bam_buffer;  // recently-used buffer
 static buffer_t *bam_buffer2; // secondary buffer
 static uint8_t   bam_refcount;
@@ -103,24 +257,45 @@ static void format_d71_image(uint8_t part, buffer_t *buf, uint8_t *name, uint8_t
 static void format_d81_image(uint8_t part, buffer_t *buf, uint8_t *name, uint8_t *idbuf);
 static void format_dnp_image(uint8_t part, buffer_t *buf, uint8_t *name, uint8_t *idbuf);
 
+static uint8_t d41_bam_locate(uint8_t track, uint8_t type, uint8_t *ts);
+static uint8_t d71_bam_locate(uint8_t track, uint8_t type, uint8_t *ts);
+static uint8_t d81_bam_locate(uint8_t track, uint8_t type, uint8_t *ts);
+static uint8_t dnp_bam_locate(uint8_t track, uint8_t type, uint8_t *ts);
+
 /* ------------------------------------------------------------------------- */
 /*  Utility functions                                                        */
 /* ------------------------------------------------------------------------- */
 
+/* LBA of the first sector of every 1541/1571 track, plus the end of track 70 */
+static const PROGMEM uint16_t d71_track_lba[71] = {
+     0,   21,   42,   63,   84,  105,  126,  147,  168,
+   189,  210,  231,  252,  273,  294,  315,  336,  357,
+   376,  395,  414,  433,  452,  471,  490,  508,  526,
+   544,  562,  580,  598,  615,  632,  649,  666,  683,
+   704,  725,  746,  767,  788,  809,  830,  851,  872,
+   893,  914,  935,  956,  977,  998, 1019, 1040, 1059,
+  1078, 1097, 1116, 1135, 1154, 1173, 1191, 1209, 1227,
+  1245, 1263, 1281, 1298, 1315, 1332, 1349, 1366
+};
+
 static const PROGMEM struct param_s d41param = {
-  18, 1, 35, 0x90, 0xa2, 10, 3, format_d41_image
+  18, 1, 35, 0x90, 0xa2, 10, 3, format_d41_image,
+  d71_track_lba, 0, d41_bam_locate
 };
 
 static const PROGMEM struct param_s d71param = {
-  18, 1, 70, 0x90, 0xa2, 6, 3, format_d71_image
+  18, 1, 70, 0x90, 0xa2, 6, 3, format_d71_image,
+  d71_track_lba, 0, d71_bam_locate
 };
 
 static const PROGMEM struct param_s d81param = {
-  40, 3, 80, 0x04, 0x16, 1, 1, format_d81_image
+  40, 3, 80, 0x04, 0x16, 1, 1, format_d81_image,
+  NULL, 40, d81_bam_locate
 };
 
 static const PROGMEM struct param_s dnpparam = {
-  1, 1, 0, DNP_LABEL_OFFSET, DNP_ID_OFFSET, 1, 1, format_dnp_image
+  1, 1, 0, DNP_LABEL_OFFSET, DNP_ID_OFFSET, 1, 1, format_dnp_image,
+  NULL, 256, dnp_bam_locate
 };
 
 /**
@@ -142,35 +317,18 @@ static uint8_t get_param(uint8_t part, param_t param) {
  * @sector: Sector number
  *
  * Calculates an LBA-style sector number for a given track/sector pair.
+ * Zoned images use the track table selected at mount time, all others
+ * have the same number of sectors on every track.
  */
-/* This version used the least code of all tested variants. */
 static uint16_t sector_lba(uint8_t part, uint8_t track, const uint8_t sector) {
-  uint16_t offset = 0;
+  const uint16_t *table = partition[part].d64data.track_lba;
 
   track--; /* Track numbers are 1-based */
 
-  switch (partition[part].imagetype & D64_TYPE_MASK) {
-  case D64_TYPE_D41:
-  case D64_TYPE_D71:
-  default:
-    if (track >= 35) {
-      offset = 683;
-      track -= 35;
-    }
-    if (track < 17)
-      return track*21 + sector + offset;
-    if (track < 24)
-      return 17*21 + (track-17)*19 + sector + offset;
-    if (track < 30)
-      return 17*21 + 7*19 + (track-24)*18 + sector + offset;
-    return 17*21 + 7*19 + 6*18 + (track-30)*17 + sector + offset;
-
-  case D64_TYPE_D81:
-    return track*40 + sector;
-
-  case D64_TYPE_DNP:
-    return track*256 + sector;
-  }
+  if (table != NULL)
+    return pgm_read_word(table + track) + sector;
+  else
+    return track * partition[part].d64data.sectors + sector;
 }
 
 /**
@@ -194,28 +352,107 @@ static uint32_t sector_offset(uint8_t part, uint8_t track, const uint8_t sector)
  * of a 1541/71/81 disk. Invalid track numbers will return invalid results.
  */
 static uint16_t sectors_per_track(uint8_t part, uint8_t track) {
-  switch (partition[part].imagetype & D64_TYPE_MASK) {
-  case D64_TYPE_D41:
-  case D64_TYPE_D71:
-  default:
-    if (track > 35)
-      track -= 35;
-    if (track < 18)
-      return 21;
-    if (track < 25)
-      return 19;
-    if (track < 31)
-      return 18;
-    return 17;
+  const uint16_t *table = partition[part].d64data.track_lba;
 
-  case D64_TYPE_D81:
-    return 40;
+  if (table != NULL)
+    return pgm_read_word(table + track) - pgm_read_word(table + track - 1);
+  else
+    return partition[part].d64data.sectors;
+}
 
-  case D64_TYPE_DNP:
-    return 256;
+/* ------------------------------------------------------------------------- */
+/*  Track cache                                                              */
+/* ------------------------------------------------------------------------- */
+
+#ifdef CONFIG_TRACK_CACHE
+/**
+ * trackcache_invalidate - invalidate the track cache
+ *
+ * This function marks the contents of the track cache as invalid.
+ */
+static void trackcache_invalidate(void) {
+  trackcache.part = 255;
+}
+
+#  ifdef CONFIG_RAM_POOL
+/**
+ * d64_trackcache_setup - set the memory used by the track cache
+ * @data   : pointer to the cache memory
+ * @sectors: number of sectors that fit into it
+ *
+ * This function is called by buffers_init with the part of the
+ * RAM pool that is used for the track cache. buffers_init leaves
+ * at least one sector for it unless the pool is empty, with 0 sectors
+ * the cache is disabled and sectors are read from the image directly.
+ */
+void d64_trackcache_setup(uint8_t *data, uint8_t sectors) {
+  trackcache_data    = data;
+  trackcache_sectors = sectors;
+  trackcache_invalidate();
+}
+#  endif
+
+/**
+ * sector_read - read data from a sector using the track cache
+ * @part  : partition number
+ * @track : track number
+ * @sector: sector number
+ * @offset: offset of the data within the sector
+ * @buf   : pointer to where the data should be read to
+ * @len   : number of bytes to be read
+ *
+ * This function reads @len bytes starting at @offset of the specified
+ * sector into @buf. If the sector is not in the track cache, the complete
+ * track is read into the cache first. Tracks that are larger than
+ * the cache (DNP) are loaded in aligned chunks of TRACKCACHE_SECTORS.
+ * Assumes that track and sector have already been range-checked.
+ * Returns the same as image_read.
+ */
+static uint8_t sector_read(uint8_t part, uint8_t track, uint8_t sector,
+                           uint8_t offset, uint8_t *buf, uint16_t len) {
+  uint16_t lba = sector_lba(part, track, sector);
+
+#  ifdef CONFIG_RAM_POOL
+  if (trackcache_sectors == 0)
+    return image_read(part, sector_offset(part, track, sector) + offset,
+                      buf, len);
+#  endif
+
+  if (trackcache.part != part ||
+      lba < trackcache.first || lba >= trackcache.first + trackcache.count) {
+    uint16_t count = sectors_per_track(part, track);
+    uint8_t  start = 0;
+
+    if (count > TRACKCACHE_SECTORS) {
+      start = sector - sector % TRACKCACHE_SECTORS;
+      count = count - start;
+      if (count > TRACKCACHE_SECTORS)
+        count = TRACKCACHE_SECTORS;
+    }
+
+    trackcache.part = 255;
+    if (image_read(part, sector_offset(part, track, start),
+                   trackcache_data, count * 256))
+      /* fall back to an uncached read, e.g. for truncated images */
+      return image_read(part, sector_offset(part, track, sector) + offset,
+                        buf, len);
+
+    trackcache.part  = part;
+    trackcache.first = lba - (sector - start);
+    trackcache.count = count;
   }
+
+  memcpy(buf, trackcache_data + 256 * (lba - trackcache.first) + offset, len);
+  return 0;
 }
 
+#else
+
+#  define trackcache_invalidate() do {} while (0)
+#  define sector_read(part,track,sector,offset,buf,len) \
+     image_read(part, sector_offset(part, track, sector) + (offset), buf, len)
+#endif
+
 /**
  * checked_read - read a specified sector after range-checking
  * @part  : partition number
@@ -286,9 +523,353 @@ static uint8_t checked_read(uint8_t part, uint8_t track, uint8_t sector, uint8_t
     /* 1 is OK, unknown values are accepted too */
   }
 
-  return image_read(part, sector_offset(part,track,sector), buf, len);
+  return sector_read(part, track, sector, 0, buf, len);
+}
+
+/* ------------------------------------------------------------------------- */
+/*  Sector chain prefetch                                                    */
+/* ------------------------------------------------------------------------- */
+
+#ifdef CONFIG_CHAIN_PREFETCH
+/**
+ * prefetch_drop - cleanup callback for the prefetch buffer
+ * @buf: pointer to the prefetch buffer
+ *
+ * This function is called when the prefetch buffer is freed, either
+ * by d64_prefetch_cancel or when the buffer is reclaimed because
+ * no other buffer is available. Always returns 0.
+ */
+static uint8_t prefetch_drop(buffer_t *buf) {
+  prefetch.buf = NULL;
+  return 0;
+}
+
+/**
+ * d64_prefetch_cancel - drop the prefetched sector
+ *
+ * This function discards the prefetched sector (if any)
+ * and releases its buffer.
+ */
+void d64_prefetch_cancel(void) {
+  if (prefetch.buf)
+    cleanup_and_free_buffer(prefetch.buf);
+}
+
+/**
+ * prefetch_request - schedule a prefetch for the next sector of a file
+ * @buf: buffer of the file, data[0]/data[1] hold the link
+ *
+ * This function records the sector that @buf links to so it can be
+ * read by d64_prefetch_service while the bus is idle. The final sector
+ * of a file cancels the prefetch instead. Failing to allocate a buffer
+ * for the prefetch is not an error.
+ */
+static void prefetch_request(buffer_t *buf) {
+  if (buf->data[0] == 0) {
+    d64_prefetch_cancel();
+    return;
+  }
+
+  if (prefetch.buf == NULL) {
+    uint8_t olderror = current_error;
+
+    prefetch.buf = alloc_system_buffer();
+    if (prefetch.buf == NULL) {
+      /* not enough buffers, restore the previous error message */
+      set_error(olderror);
+      return;
+    }
+
+    set_buffer_secondary(prefetch.buf, BUFFER_SYS_PREFETCH);
+    prefetch.buf->cleanup   = prefetch_drop;
+    stick_buffer(prefetch.buf);
+  }
+
+  prefetch.part   = buf->pvt.d64.part;
+  prefetch.track  = buf->data[0];
+  prefetch.sector = buf->data[1];
+  prefetch.valid  = 0;
+}
+
+/**
+ * prefetch_get - get the next sector of a file from the prefetch buffer
+ * @buf: buffer of the file, data[0]/data[1] hold the link
+ *
+ * This function copies the sector that @buf links to into @buf if
+ * it has already been prefetched. Returns 1 if it was, 0 if the
+ * caller needs to read the sector itself.
+ */
+static uint8_t prefetch_get(buffer_t *buf) {
+  if (prefetch.buf == NULL || !prefetch.valid ||
+      prefetch.part   != buf->pvt.d64.part ||
+      prefetch.track  != buf->data[0] ||
+      prefetch.sector != buf->data[1])
+    return 0;
+
+  memcpy(buf->data, prefetch.buf->data, 256);
+  return 1;
+}
+
+/**
+ * d64_prefetch_service - read a pending prefetch sector
+ *
+ * This function reads the sector requested by the last call to
+ * prefetch_request. It is called by the bus layer when the bus is
+ * idle. Errors are not reported here, the prefetch is dropped instead
+ * so the regular read reports the error when the sector is needed.
+ */
+void d64_prefetch_service(void) {
+  uint8_t olderror;
+
+  if (prefetch.buf == NULL || prefetch.valid)
+    return;
+
+  olderror = current_error;
+  if (checked_read(prefetch.part, prefetch.track, prefetch.sector,
+                   prefetch.buf->data, 256, ERROR_ILLEGAL_TS_LINK)) {
+    set_error(olderror);
+    d64_prefetch_cancel();
+    return;
+  }
+
+  prefetch.valid = 1;
+}
+
+#else
+
+#  define prefetch_request(buf) do {} while (0)
+#  define prefetch_get(buf)     0
+
+#endif
+
+#ifdef CONFIG_IMAGE_SYNC_SECTORS
+/**
+ * image_commit - sync pending writes to the image file
+ *
+ * This function flushes the writes to the image file whose sync was
+ * deferred by dxx_write to the storage medium.
+ */
+static void image_commit(void) {
+  if (imagesync.part != 255) {
+    image_sync(imagesync.part);
+    imagesync.part = 255;
+  }
+}
+#else
+#  define image_commit() do {} while (0)
+#endif
+
+/**
+ * dxx_write - write data to the image file
+ * @part  : partition number
+ * @offset: offset to be seeked to
+ * @buffer: pointer to the data to be written
+ * @bytes : number of bytes to be written
+ * @flush : Flags if written data should be flushed to disk immediately
+ *
+ * This function is a wrapper around image_write that invalidates the
+ * track cache, the prefetched sector, the directory name index and
+ * the file seek index if the write touches them.
+ * The cached directory sector is updated with the new data instead.
+ * With CONFIG_IMAGE_SYNC_SECTORS, @flush only requests a sync which
+ * is done after that many requests or by image_commit.
+ * Returns the same as image_write.
+ */
+static uint8_t dxx_write(uint8_t part, uint32_t offset, void *buffer,
+                         uint16_t bytes, uint8_t flush) {
+#ifdef CONFIG_TRACK_CACHE
+  if (trackcache.part == part &&
+      offset / 256 < trackcache.first + trackcache.count &&
+      (offset + bytes - 1) / 256 >= trackcache.first)
+    trackcache_invalidate();
+#endif
+
+#ifdef CONFIG_CHAIN_PREFETCH
+  if (prefetch.buf && prefetch.part == part) {
+    uint16_t lba = sector_lba(part, prefetch.track, prefetch.sector);
+
+    if (offset / 256 <= lba && (offset + bytes - 1) / 256 >= lba)
+      d64_prefetch_cancel();
+  }
+#endif
+
+#ifdef CONFIG_DIR_INDEX
+  if (dirindex.part == part) {
+    uint16_t first = offset / 256;
+    uint16_t last  = (offset + bytes - 1) / 256;
+
+    for (uint8_t i = 0; i < dirindex.sectors; i++) {
+      uint16_t lba = sector_lba(part, dirindex.ts[i][0], dirindex.ts[i][1]);
+
+      if (lba >= first && lba <= last) {
+        dirindex.part = 255;
+        break;
+      }
+    }
+  }
+#endif
+
+#ifdef CONFIG_SEEK_INDEX
+  /* only writes to the link bytes of a sector can change a file chain */
+  if (seekindex.part == part &&
+      ((offset & 0xff) < 2 || bytes > 256 - (offset & 0xff))) {
+    uint16_t first = offset / 256;
+    uint16_t last  = (offset + bytes - 1) / 256;
+
+    for (uint16_t i = 0; i < seekindex.count; i++) {
+      uint16_t lba = sector_lba(part, seekindex.ts[i][0], seekindex.ts[i][1]);
+
+      if (lba >= first && lba <= last) {
+        seekindex.part = 255;
+        break;
+      }
+    }
+  }
+#endif
+
+#ifdef CONFIG_IMAGE_SYNC_SECTORS
+  if (imagesync.part != part) {
+    image_commit();
+    imagesync.part  = part;
+    imagesync.count = 0;
+  }
+
+  if (flush) {
+    if (++imagesync.count >= CONFIG_IMAGE_SYNC_SECTORS)
+      /* sync with this write */
+      imagesync.part = 255;
+    else
+      flush = 0;
+  }
+#endif
+
+#ifdef CONFIG_DIR_CACHE
+  if (dircache.part == part) {
+    uint32_t start = sector_offset(part, dircache.track, dircache.sector);
+
+    /* keep the cached directory sector in sync with the image */
+    if (offset < start + 256 && offset + bytes > start) {
+      uint32_t first = (offset > start) ? offset : start;
+      uint32_t end   = offset + bytes;
+
+      if (end > start + 256)
+        end = start + 256;
+
+      memcpy(dircache.data + (first - start),
+             (uint8_t *)buffer + (first - offset), end - first);
+    }
+  }
+
+  uint8_t res = image_write(part, offset, buffer, bytes, flush);
+
+  /* a batched scratch still needs the sector, dircache_flush retries */
+  if (res && !dircache_dirty())
+    dircache.part = 255;
+
+  return res;
+#else
+  return image_write(part, offset, buffer, bytes, flush);
+#endif
+}
+
+/* ------------------------------------------------------------------------- */
+/*  Directory sector cache                                                   */
+/* ------------------------------------------------------------------------- */
+
+#ifdef CONFIG_DIR_CACHE
+#  ifdef CONFIG_SCRATCH_BATCH
+/**
+ * dircache_flush - write back the cached directory sector
+ *
+ * While a scratch command deletes several files, d64_delete clears
+ * their entries only in the directory cache. This function writes the
+ * changed sector to the image, once for all entries in it. Returns 0 if
+ * successful or 1 if the write failed, the sector stays dirty then and
+ * is written by the next call.
+ */
+static uint8_t dircache_flush(void) {
+  uint8_t part = dircache.part;
+  uint8_t res;
+
+  if (!dircache.dirty)
+    return 0;
+
+  /* dxx_write must not copy the sector onto itself */
+  dircache.part = 255;
+  res = dxx_write(part, sector_offset(part, dircache.track, dircache.sector),
+                  dircache.data, 256, 1);
+  dircache.part = part;
+  if (res)
+    return 1;
+
+  dircache.dirty = 0;
+  return 0;
+}
+#  else
+static inline uint8_t dircache_flush(void) { return 0; }
+#  endif
+
+/**
+ * dircache_invalidate - invalidate the directory sector cache
+ *
+ * This function writes back pending changes and marks the contents
+ * of the directory sector cache as invalid.
+ */
+static void dircache_invalidate(void) {
+  dircache_flush();
+  dircache.part = 255;
+#  ifdef CONFIG_SCRATCH_BATCH
+  dircache.dirty = 0;
+#  endif
+}
+
+/**
+ * dir_read - read data from a directory sector
+ * @part  : partition number
+ * @track : track number
+ * @sector: sector number
+ * @offset: offset of the data within the sector
+ * @buf   : pointer to where the data should be read to
+ * @len   : number of bytes to be read
+ *
+ * This function reads @len bytes starting at @offset of the specified
+ * directory sector into @buf. The complete sector is kept in the
+ * directory cache, so walking through a directory needs only one image
+ * access per sector. Writes to the image update the cached sector in
+ * dxx_write. Returns the same as checked_read.
+ */
+static uint8_t dir_read(uint8_t part, uint8_t track, uint8_t sector,
+                        uint8_t offset, uint8_t *buf, uint8_t len) {
+  if (dircache.part != part || dircache.track != track ||
+      dircache.sector != sector) {
+    uint8_t res;
+
+    if (dircache_flush())
+      return 2;
+
+    dircache.part = 255;
+    res = checked_read(part, track, sector, dircache.data, 256,
+                       ERROR_ILLEGAL_TS_LINK);
+    if (res)
+      return res;
+
+    dircache.part   = part;
+    dircache.track  = track;
+    dircache.sector = sector;
+  }
+
+  memcpy(buf, dircache.data + offset, len);
+  return 0;
 }
 
+#else
+
+#  define dircache_invalidate() do {} while (0)
+static inline uint8_t dircache_flush(void) { return 0; }
+#  define dir_read(part,track,sector,offset,buf,len) \
+     sector_read(part, track, sector, offset, buf, len)
+#endif
+
 /**
  * update_timestamp - update timestamp of a directory entry
  * @buffer: pointer to the directory entry
@@ -329,8 +910,8 @@ static void update_timestamp(uint8_t *buffer) {
  * Returns the same as image_write
  */
 static uint8_t write_entry(uint8_t part, struct d64dh *dh, uint8_t *buf, uint8_t flush) {
-  return image_write(part, sector_offset(part, dh->track, dh->sector) +
-                           dh->entry * 32, buf, 32, flush);
+  return dxx_write(part, sector_offset(part, dh->track, dh->sector) +
+                         dh->entry * 32, buf, 32, flush);
 }
 
 /**
@@ -345,8 +926,7 @@ static uint8_t write_entry(uint8_t part, struct d64dh *dh, uint8_t *buf, uint8_t
  * Returns the same as image_read (0 success, 1 partial read, 2 failed)
  */
 static uint8_t read_entry(uint8_t part, struct d64dh *dh, uint8_t *buf) {
-  return image_read(part, sector_offset(part, dh->track, dh->sector) +
-                          dh->entry * 32, buf, 32);
+  return dir_read(part, dh->track, dh->sector, dh->entry * 32, buf, 32);
 }
 
 /**
@@ -375,7 +955,7 @@ static uint8_t clear_dir_sector(uint8_t part, uint8_t t, uint8_t s, uint8_t *dat
   memset(data, 0, 256);
 
   data[1] = 0xff;
-  return image_write(part, sector_offset(part, t, s), data, 256, 0);
+  return dxx_write(part, sector_offset(part, t, s), data, 256, 0);
 }
 
 
@@ -393,12 +973,13 @@ static uint8_t clear_dir_sector(uint8_t part, uint8_t t, uint8_t s, uint8_t *dat
 static uint8_t bam_buffer_flush(buffer_t *buf) {
   uint8_t res;
 
-  if (buf->mustflush && buf->pvt.bam.part < max_part) {
-    res = image_write(buf->pvt.bam.part,
-                      sector_offset(buf->pvt.bam.part,
-                                    buf->pvt.bam.track,
-                                    buf->pvt.bam.sector),
-                      buf->data, 256, 1);
+  if (buf->mustflush && (buf->pvt.bam.part < max_part ||
+                         is_image_slot(buf->pvt.bam.part))) {
+    res = dxx_write(buf->pvt.bam.part,
+                    sector_offset(buf->pvt.bam.part,
+                                  buf->pvt.bam.track,
+                                  buf->pvt.bam.sector),
+                    buf->data, 256, 1);
     buf->mustflush = 0;
 
     return res;
@@ -410,17 +991,26 @@ static uint8_t bam_buffer_flush(buffer_t *buf) {
  * d64_bam_commit - write BAM buffers to disk
  *
  * This function is the exported interface to force the BAM buffer
- * contents to disk. Returns 0 if successful, != 0 otherwise.
+ * contents to disk. Pending writes to the image and a directory
+ * sector changed by a batched scratch are synced too. If that sector
+ * cannot be written, the BAM is left alone as well, so it never shows
+ * the blocks of files as free that are still in the directory.
+ * Returns 0 if successful, != 0 otherwise.
  */
 uint8_t d64_bam_commit(void) {
   uint8_t res = 0;
 
+  if (dircache_flush())
+    return 1;
+
   if (bam_buffer)
     res |= bam_buffer->cleanup(bam_buffer);
 
   if (bam_buffer2)
     res |= bam_buffer2->cleanup(bam_buffer2);
 
+  image_commit();
+
   return 0;
 }
 
@@ -437,7 +1027,7 @@ static uint8_t bam_buffer_alloc(buffer_t **buf) {
   if (!*buf)
     return 1;
 
-  (*buf)->secondary    = BUFFER_SYS_BAM;
+  set_buffer_secondary(*buf, BUFFER_SYS_BAM);
   (*buf)->pvt.bam.part = 255;
   (*buf)->cleanup      = bam_buffer_flush;
   stick_buffer(*buf);
@@ -477,6 +1067,52 @@ static uint8_t bam_buffer_match(buffer_t *buf, uint8_t part,
     return 0;
 }
 
+/**
+ * d41_bam_locate - find the BAM entry of a track on a 1541 disk
+ * @track: track number
+ * @type : type of BAM data requested
+ * @ts   : pointer to the track/sector of the BAM sector (output)
+ *
+ * This function stores the track/sector of the BAM sector that holds
+ * the requested data for @track in @ts and returns its offset within
+ * this sector. The functions for the other image types work the same.
+ */
+static uint8_t d41_bam_locate(uint8_t track, uint8_t type, uint8_t *ts) {
+  ts[0] = D41_BAM_TRACK;
+  ts[1] = D41_BAM_SECTOR;
+  return D41_BAM_BYTES_PER_TRACK * track + (type == BAM_BITFIELD ? 1:0);
+}
+
+static uint8_t d71_bam_locate(uint8_t track, uint8_t type, uint8_t *ts) {
+  if (track > 35 && type == BAM_BITFIELD) {
+    ts[0] = D71_BAM2_TRACK;
+    ts[1] = D71_BAM2_SECTOR;
+    return (track - 36) * D71_BAM2_BYTES_PER_TRACK;
+  }
+
+  if (track > 35) {
+    ts[0] = D41_BAM_TRACK;
+    ts[1] = D41_BAM_SECTOR;
+    return (track - 36) + D71_BAM_COUNTER2OFFSET;
+  }
+
+  return d41_bam_locate(track, type, ts);
+}
+
+static uint8_t d81_bam_locate(uint8_t track, uint8_t type, uint8_t *ts) {
+  ts[0] = D81_BAM_TRACK;
+  ts[1] = (track < 41 ? D81_BAM_SECTOR1 : D81_BAM_SECTOR2);
+  if (track > 40)
+    track -= 40;
+  return D81_BAM_OFFSET + track * D81_BAM_BYTES_PER_TRACK + (type == BAM_BITFIELD ? 1:0);
+}
+
+static uint8_t dnp_bam_locate(uint8_t track, uint8_t type, uint8_t *ts) {
+  ts[0] = DNP_BAM_TRACK;
+  ts[1] = DNP_BAM_SECTOR + (track >> 3);
+  return (track & 0x07) * 32;
+}
+
 /**
  * move_bam_window - read correct BAM sector into window.
  * @part  : partition
@@ -495,46 +1131,11 @@ static uint8_t bam_buffer_match(buffer_t *buf, uint8_t part,
  */
 static uint8_t move_bam_window(uint8_t part, uint8_t track, bamdata_t type, uint8_t **ptr) {
   uint8_t res;
-  uint8_t t,s, pos;
+  uint8_t t,s, pos, ts[2];
 
-  switch(partition[part].imagetype & D64_TYPE_MASK) {
-  case D64_TYPE_D41:
-  default:
-    t   = D41_BAM_TRACK;
-    s   = D41_BAM_SECTOR;
-    pos = D41_BAM_BYTES_PER_TRACK * track + (type == BAM_BITFIELD ? 1:0);
-    break;
-
-  case D64_TYPE_D71:
-    if (track > 35 && type == BAM_BITFIELD) {
-      t   = D71_BAM2_TRACK;
-      s   = D71_BAM2_SECTOR;
-      pos = (track - 36) * D71_BAM2_BYTES_PER_TRACK;
-    } else {
-      t = D41_BAM_TRACK;
-      s = D41_BAM_SECTOR;
-      if (track > 35) {
-        pos = (track - 36) + D71_BAM_COUNTER2OFFSET;
-      } else {
-        pos = D41_BAM_BYTES_PER_TRACK * track + (type == BAM_BITFIELD ? 1:0);
-      }
-    }
-    break;
-
-  case D64_TYPE_D81:
-    t   = D81_BAM_TRACK;
-    s   = (track < 41 ? D81_BAM_SECTOR1 : D81_BAM_SECTOR2);
-    if (track > 40)
-      track -= 40;
-    pos = D81_BAM_OFFSET + track * D81_BAM_BYTES_PER_TRACK + (type == BAM_BITFIELD ? 1:0);
-    break;
-
-  case D64_TYPE_DNP:
-    t   = DNP_BAM_TRACK;
-    s   = DNP_BAM_SECTOR + (track >> 3);
-    pos = (track & 0x07) * 32;
-    break;
-  }
+  pos = partition[part].d64data.bam_locate(track, type, ts);
+  t   = ts[0];
+  s   = ts[1];
 
   if (!bam_buffer_match(bam_buffer, part, t, s)) {
     /* check if the second BAM buffer exists */
@@ -646,6 +1247,94 @@ static uint16_t sectors_free(uint8_t part, uint8_t track) {
   }
 }
 
+/**
+ * has_free_sectors - checks if a track has free sectors
+ * @part  : partition
+ * @track : track number
+ *
+ * This function returns true if the given track of partition part
+ * has at least one free sector. Unlike sectors_free it does not count
+ * the free sectors of DNP tracks, but stops at the first BAM byte
+ * with a free sector.
+ */
+static uint8_t has_free_sectors(uint8_t part, uint8_t track) {
+  uint8_t *trackmap;
+
+  if (partition[part].imagetype != D64_TYPE_DNP)
+    return sectors_free(part, track) != 0;
+
+  if (track < 1 || track > get_param(part, LAST_TRACK) ||
+      move_bam_window(part, track, BAM_BITFIELD, &trackmap))
+    return 0;
+
+  for (uint8_t i=0;i < DNP_BAM_BYTES_PER_TRACK;i++)
+    if (trackmap[i])
+      return 1;
+
+  return 0;
+}
+
+/**
+ * scan_bitfield - find the first free sector in a part of a BAM bitfield
+ * @bitfield: pointer to the BAM bitfield of the track
+ * @reversed: true if sector 0 is the MSB of the first byte (DNP)
+ * @from    : first sector to check
+ * @to      : first sector that is not checked anymore
+ *
+ * This function returns the number of the first sector in the range
+ * [@from, @to) that is marked as free in @bitfield or -1 if there is
+ * none. Bytes without free sectors are skipped as a whole.
+ */
+static int16_t scan_bitfield(uint8_t *bitfield, uint8_t reversed,
+                             uint16_t from, uint16_t to) {
+  while (from < to) {
+    uint8_t bits = bitfield[from >> 3];
+
+    if (bits == 0) {
+      /* no free sector in this byte */
+      from = (from | 7) + 1;
+      continue;
+    }
+
+    if (bits & (reversed ? 0x80 >> (from & 7) : 1 << (from & 7)))
+      return from;
+
+    from++;
+  }
+
+  return -1;
+}
+
+/**
+ * find_free_sector - find the next free sector on a track
+ * @part  : partition
+ * @track : track number
+ * @sector: pointer to the first sector to check, receives the result
+ *
+ * This function searches the BAM of the given track for the first free
+ * sector at or after *@sector, wrapping around to sector 0 at the end
+ * of the track. Returns 0 if a free sector was found, 1 otherwise.
+ */
+static uint8_t find_free_sector(uint8_t part, uint8_t track, uint8_t *sector) {
+  uint8_t *bitfield;
+  uint16_t count = sectors_per_track(part, track);
+  uint8_t  reversed = (partition[part].imagetype == D64_TYPE_DNP);
+  int16_t  res;
+
+  if (move_bam_window(part, track, BAM_BITFIELD, &bitfield))
+    return 1;
+
+  res = scan_bitfield(bitfield, reversed, *sector, count);
+  if (res < 0)
+    res = scan_bitfield(bitfield, reversed, 0, *sector);
+
+  if (res < 0)
+    return 1;
+
+  *sector = res;
+  return 0;
+}
+
 /**
  * allocate_sector - mark a sector as used
  * @part  : partitoin
@@ -759,18 +1448,21 @@ static uint8_t get_first_sector(uint8_t part, uint8_t *track, uint8_t *sector) {
   /* CMD drives, but track 1 seems to be semi-reserved for directory sectors.*/
   if (partition[part].imagetype == D64_TYPE_DNP) {
     *track = 2;
-    while (sectors_free(part, *track) == 0) {
+    while (!has_free_sectors(part, *track)) {
       (*track)++;
 
-      if (*track == get_param(part, LAST_TRACK) ||
+      if (*track > get_param(part, LAST_TRACK) ||
           *track == 0) {
         /* Wrap to track 1 */
         *track = 1;
       }
 
-      if (*track == 2)
+      if (*track == 2) {
         /* If we're at track 2 again there are no free sectors anywhere */
+        if (current_error == ERROR_OK)
+          set_error(ERROR_DISK_FULL);
         return 1;
+      }
     }
   } else {
     /* Look for a track with free sectors close to the directory */
@@ -796,9 +1488,9 @@ static uint8_t get_first_sector(uint8_t part, uint8_t *track, uint8_t *sector) {
   }
 
   /* Search for the first free sector on this track */
-  for (*sector = 0;*sector < sectors_per_track(part, *track); *sector += 1)
-    if (is_free(part, *track, *sector) > 0)
-      return 0;
+  *sector = 0;
+  if (!find_free_sector(part, *track, sector))
+    return 0;
 
   /* If we're here the BAM is invalid or couldn't be read */
   if (current_error == ERROR_OK)
@@ -816,6 +1508,9 @@ static uint8_t get_first_sector(uint8_t part, uint8_t *track, uint8_t *sector) {
  * based on the current sector in the variables pointed to by track/sector.
  * The algorithm is based on the description found at
  * http://ist.uwaterloo.ca/~schepers/formats/DISK.TXT
+ * If CARD_INTERLEAVE is set, file sectors are allocated with interleave 1
+ * and a new track is started at sector 0, so consecutive blocks of a file
+ * are adjacent in the image file.
  * Returns 0 if successful or 1 if any error occured.
  */
 static uint8_t get_next_sector(uint8_t part, uint8_t *track, uint8_t *sector) {
@@ -823,18 +1518,21 @@ static uint8_t get_next_sector(uint8_t part, uint8_t *track, uint8_t *sector) {
     uint8_t newtrack = *track;
 
     /* Find a track with free sectors */
-    while (sectors_free(part, newtrack) == 0) {
+    while (!has_free_sectors(part, newtrack)) {
       newtrack++;
 
-      if (newtrack == get_param(part, LAST_TRACK) ||
+      if (newtrack > get_param(part, LAST_TRACK) ||
           newtrack == 0) {
         /* Wrap to track 1 */
         newtrack = 1;
       }
 
-      if (newtrack == *track)
+      if (newtrack == *track) {
         /* Returned to the start track -> no free sectors anywhere */
+        if (current_error == ERROR_OK)
+          set_error(ERROR_DISK_FULL);
         return 1;
+      }
     }
 
     uint8_t newsector;
@@ -847,8 +1545,11 @@ static uint8_t get_next_sector(uint8_t part, uint8_t *track, uint8_t *sector) {
       newsector = 0;
     }
 
-    while (!is_free(part, newtrack, newsector))
-      newsector++; // will automatically wrap from 255->0
+    if (find_free_sector(part, newtrack, &newsector)) {
+      if (current_error == ERROR_OK)
+        set_error(ERROR_DISK_FULL);
+      return 1;
+    }
 
     *track = newtrack;
     *sector = newsector;
@@ -857,6 +1558,7 @@ static uint8_t get_next_sector(uint8_t part, uint8_t *track, uint8_t *sector) {
   }
 
   uint8_t interleave,tries;
+  uint8_t oldtrack = *track;
 
   if (*track == get_param(part, DIR_TRACK)) {
     if (sectors_free(part, get_param(part, DIR_TRACK)) == 0) {
@@ -865,6 +1567,8 @@ static uint8_t get_next_sector(uint8_t part, uint8_t *track, uint8_t *sector) {
       return 1;
     }
     interleave = get_param(part, DIR_INTERLEAVE);
+  } else if (globalflags & CARD_INTERLEAVE) {
+    interleave = 1;
   } else
     interleave = get_param(part, FILE_INTERLEAVE);
 
@@ -900,23 +1604,21 @@ static uint8_t get_next_sector(uint8_t part, uint8_t *track, uint8_t *sector) {
     return 1;
   }
 
-  /* Look for a sector at interleave distance */
-  *sector += interleave;
-  if (*sector >= sectors_per_track(part, *track)) {
-    *sector -= sectors_per_track(part, *track);
-    if (*sector != 0)
-      *sector -= 1;
+  if ((globalflags & CARD_INTERLEAVE) && *track != oldtrack) {
+    /* Continue at the start of the new track */
+    *sector = 0;
+  } else {
+    /* Look for a sector at interleave distance */
+    *sector += interleave;
+    if (*sector >= sectors_per_track(part, *track)) {
+      *sector -= sectors_per_track(part, *track);
+      if (*sector != 0)
+        *sector -= 1;
+    }
   }
 
   /* Increase distance until an empty sector is found */
-  tries = 99;
-  while (is_free(part,*track,*sector) <= 0 && tries--) {
-    *sector += 1;
-    if (*sector >= sectors_per_track(part, *track))
-      *sector = 0;
-  }
-
-  if (tries)
+  if (!find_free_sector(part, *track, sector))
     return 0;
 
   if (current_error == ERROR_OK)
@@ -937,7 +1639,11 @@ static int8_t nextdirentry(dh_t *dh) {
   /* End of directory entries in this sector? */
   if (dh->dir.d64.entry == 8) {
     /* Read link pointer */
+#ifdef CONFIG_DIR_CACHE
+    if (dir_read(dh->part, dh->dir.d64.track, dh->dir.d64.sector, 0, entrybuf, 2))
+#else
     if (checked_read(dh->part, dh->dir.d64.track, dh->dir.d64.sector, entrybuf, 2, ERROR_ILLEGAL_TS_LINK))
+#endif
       return 1;
 
     /* Final directory sector? */
@@ -963,6 +1669,154 @@ static int8_t nextdirentry(dh_t *dh) {
   return 0;
 }
 
+/* ------------------------------------------------------------------------- */
+/*  Directory name index                                                     */
+/* ------------------------------------------------------------------------- */
+
+#ifdef CONFIG_DIR_INDEX
+/**
+ * dirindex_invalidate - invalidate the directory name index
+ *
+ * This function marks the contents of the name index as invalid.
+ */
+static void dirindex_invalidate(void) {
+  dirindex.part = 255;
+}
+
+/**
+ * name_hash - calculate the index hash of a file name
+ * @name: pointer to the name
+ *
+ * This function calculates an 8 bit hash of a file name that is
+ * terminated by 0, 0xa0 or its maximum length. 0 is never returned
+ * because it marks empty entries in the index.
+ */
+static uint8_t name_hash(uint8_t *name) {
+  uint8_t hash = 0;
+  uint8_t i = CBM_NAME_LENGTH;
+
+  while (i-- && *name != 0 && *name != 0xa0)
+    hash = hash * 31 + *name++;
+
+  return hash ? hash : 1;
+}
+
+/**
+ * dirindex_build - build the name index for a directory
+ * @part  : partition number
+ * @track : track of the first directory sector
+ * @sector: sector of the first directory sector
+ *
+ * This function walks the directory chain starting at @track/@sector
+ * and records the name hash of every entry. If the directory is
+ * larger than the index, only its first sectors are indexed.
+ * Returns 0 if successful, != 0 otherwise.
+ */
+static uint8_t dirindex_build(uint8_t part, uint8_t track, uint8_t sector) {
+  uint8_t entry[DIR_OFS_FILE_NAME + CBM_NAME_LENGTH];
+  uint8_t link[2];
+  uint8_t *hash = dirindex.hash;
+
+  dirindex.part    = 255;
+  dirindex.sectors = 0;
+
+  do {
+    if (track < 1 || track > get_param(part, LAST_TRACK) ||
+        sector >= sectors_per_track(part, track))
+      return 1;
+
+    dirindex.ts[dirindex.sectors][0] = track;
+    dirindex.ts[dirindex.sectors][1] = sector;
+    dirindex.sectors++;
+
+    for (uint8_t i=0;i<8;i++) {
+      if (dir_read(part, track, sector, i*32, entry, sizeof(entry)))
+        return 1;
+
+      if (i == 0) {
+        /* remember the link to the next sector */
+        link[0] = entry[0];
+        link[1] = entry[1];
+      }
+
+      if (entry[DIR_OFS_FILE_TYPE] != 0)
+        *hash++ = name_hash(entry + DIR_OFS_FILE_NAME);
+      else
+        *hash++ = 0;
+    }
+
+    track  = link[0];
+    sector = link[1];
+  } while (track != 0 && dirindex.sectors < DIRINDEX_SECTORS);
+
+  dirindex.part = part;
+  return 0;
+}
+
+/**
+ * d64_find_name - skip to the next entry that may match a name
+ * @dh  : directory handle
+ * @name: file name without wildcards
+ *
+ * This function moves @dh forward to the next directory entry whose
+ * name hash matches the hash of @name, so the following readdir call
+ * returns a candidate instead of the next entry. The caller must still
+ * compare the names. The index is built if @dh is at the start of a
+ * directory that is not indexed yet. If there is no candidate, @dh is
+ * moved to the end of the indexed part of the directory. Entries
+ * beyond the index are found by the normal scan.
+ */
+void d64_find_name(dh_t *dh, uint8_t *name) {
+  struct d64dh *d64 = &dh->dir.d64;
+  uint16_t slot, end;
+  uint8_t  hash, i;
+
+  for (i=0;i<dirindex.sectors;i++)
+    if (dirindex.ts[i][0] == d64->track &&
+        dirindex.ts[i][1] == d64->sector)
+      break;
+
+  if (dirindex.part != dh->part || i == dirindex.sectors) {
+    uint8_t olderror = current_error;
+
+    /* only build the index for a scan that starts at the beginning */
+    if (d64->entry != 0)
+      return;
+
+    if (dirindex_build(dh->part, d64->track, d64->sector)) {
+      /* let the normal scan report the error */
+      dirindex_invalidate();
+      set_error(olderror);
+      return;
+    }
+
+    i = 0;
+  }
+
+  hash = name_hash(name);
+  end  = dirindex.sectors * 8;
+
+  for (slot = i * 8 + d64->entry; slot < end; slot++)
+    if (dirindex.hash[slot] == hash)
+      break;
+
+  if (slot == end) {
+    /* no candidate, continue after the last indexed sector */
+    slot = end - 1;
+    d64->entry = 8;
+  } else {
+    d64->entry = slot % 8;
+  }
+
+  d64->track  = dirindex.ts[slot / 8][0];
+  d64->sector = dirindex.ts[slot / 8][1];
+}
+
+#else
+
+#  define dirindex_invalidate() do {} while (0)
+#endif
+
 /**
  * find_empty_entry - find an empty directory entry
  * @path: path of the directory
@@ -995,7 +1849,7 @@ static uint8_t find_empty_entry(path_t *path, dh_t *dh) {
     /* Link the old sector to the new */
     entrybuf[0] = dh->dir.d64.track;
     entrybuf[1] = dh->dir.d64.sector;
-    if (image_write(path->part, sector_offset(path->part,t,s), entrybuf, 2, 0))
+    if (dxx_write(path->part, sector_offset(path->part,t,s), entrybuf, 2, 0))
       return 1;
 
     if (allocate_sector(path->part, dh->dir.d64.track, dh->dir.d64.sector))
@@ -1021,14 +1875,27 @@ static uint8_t find_empty_entry(path_t *path, dh_t *dh) {
         (*blocks)++;
 
         /* Write new block count */
-        if (image_write(path->part,
-                        sector_offset(path->part, entrybuf[0], entrybuf[1]) + entrybuf[2] + DIR_OFS_SIZE_LOW - 2,
-                        entrybuf + 3, 2, 1))
+        if (dxx_write(path->part,
+                      sector_offset(path->part, entrybuf[0], entrybuf[1]) + entrybuf[2] + DIR_OFS_SIZE_LOW - 2,
+                      entrybuf + 3, 2, 1))
           return 1;
       }
     }
 
     /* Clear the new directory sector */
+#ifdef CONFIG_DIR_CACHE
+    /* build it in the cache and write it with a single call */
+    dircache_invalidate();
+    if (clear_dir_sector(path->part, dh->dir.d64.track, dh->dir.d64.sector,
+                         dircache.data))
+      return 1;
+
+    dircache.part   = path->part;
+    dircache.track  = dh->dir.d64.track;
+    dircache.sector = dh->dir.d64.sector;
+
+    memset(entrybuf, 0, 32);
+#else
     memset(entrybuf, 0, 32);
     entrybuf[1] = 0xff;
     for (uint8_t i=0;i<256/32;i++) {
@@ -1038,6 +1905,7 @@ static uint8_t find_empty_entry(path_t *path, dh_t *dh) {
 
       entrybuf[1] = 0;
     }
+#endif
 
     /* Mark full sector as used */
     entrybuf[1] = 0xff;
@@ -1051,22 +1919,130 @@ static uint8_t find_empty_entry(path_t *path, dh_t *dh) {
   return 0;
 }
 
+/* ------------------------------------------------------------------------- */
+/*  File seek index                                                          */
+/* ------------------------------------------------------------------------- */
+
+#ifdef CONFIG_SEEK_INDEX
 /**
- * d64_read - refill-callback used for reading
- * @buf: target buffer
+ * seekindex_invalidate - invalidate the file seek index
  *
- * This is the callback used as refill for files opened for reading.
+ * This function marks the contents of the seek index as invalid.
  */
-static uint8_t d64_read(buffer_t *buf) {
+static void seekindex_invalidate(void) {
+  seekindex.part = 255;
+}
+
+/**
+ * seekindex_add - record the position of a block in the seek index
+ * @buf   : buffer of the file
+ * @block : number of the block within the file
+ * @track : track of the block
+ * @sector: sector of the block
+ *
+ * This function records the track/sector of a block that has just been
+ * reached by following the chain of the file in @buf. Block 0 of a file
+ * restarts the index for that file, other blocks are only recorded if
+ * they directly follow the indexed part of the chain. When the index is
+ * full, every second entry is dropped so it covers twice as many blocks.
+ */
+static void seekindex_add(buffer_t *buf, uint16_t block,
+                          uint8_t track, uint8_t sector) {
+  if (block == 0) {
+    seekindex.part   = buf->pvt.d64.part;
+    seekindex.track  = track;
+    seekindex.sector = sector;
+    seekindex.shift  = 0;
+    seekindex.count  = 0;
+  } else if (seekindex.part   != buf->pvt.d64.part  ||
+             seekindex.track  != buf->pvt.d64.first_track ||
+             seekindex.sector != buf->pvt.d64.first_sector) {
+    return;
+  }
+
+  if (block & ((1 << seekindex.shift) - 1) ||
+      (block >> seekindex.shift) != seekindex.count)
+    return;
+
+  if (seekindex.count == CONFIG_SEEK_INDEX_SIZE) {
+    /* halve the resolution */
+    for (uint16_t i = 1; i < CONFIG_SEEK_INDEX_SIZE / 2; i++) {
+      seekindex.ts[i][0] = seekindex.ts[2*i][0];
+      seekindex.ts[i][1] = seekindex.ts[2*i][1];
+    }
+    seekindex.count = CONFIG_SEEK_INDEX_SIZE / 2;
+    seekindex.shift++;
+  }
+
+  seekindex.ts[seekindex.count][0] = track;
+  seekindex.ts[seekindex.count][1] = sector;
+  seekindex.count++;
+}
+
+/**
+ * seekindex_lookup - find the closest indexed block before a target block
+ * @buf   : buffer of the file
+ * @target: number of the target block
+ * @ts    : pointer to a two-byte array for the track/sector
+ *
+ * This function looks up the closest block at or before @target of the
+ * file in @buf that is recorded in the seek index, stores its
+ * track/sector in @ts and returns its number. If the index does not
+ * belong to the file, 0 is returned and @ts is left unchanged.
+ */
+static uint16_t seekindex_lookup(buffer_t *buf, uint16_t target, uint8_t *ts) {
+  uint16_t i;
+
+  if (seekindex.part   != buf->pvt.d64.part  ||
+      seekindex.track  != buf->pvt.d64.first_track ||
+      seekindex.sector != buf->pvt.d64.first_sector ||
+      seekindex.count  == 0)
+    return 0;
+
+  i = target >> seekindex.shift;
+  if (i >= seekindex.count)
+    i = seekindex.count - 1;
+
+  ts[0] = seekindex.ts[i][0];
+  ts[1] = seekindex.ts[i][1];
+  return i << seekindex.shift;
+}
+
+#else
+
+#  define seekindex_invalidate()                 do {} while (0)
+#  define seekindex_add(buf,block,track,sector)  do {} while (0)
+#  define seekindex_lookup(buf,target,ts)        0
+#endif
+
+/* ------------------------------------------------------------------------- */
+/*  File access                                                              */
+/* ------------------------------------------------------------------------- */
+
+/**
+ * read_block - read a block of a file into its buffer
+ * @buf  : target buffer
+ * @block: number of the block within the file
+ *
+ * This function reads the sector whose track/sector is stored in the
+ * first two bytes of the buffer and sets up the buffer for reading
+ * from it. Returns 0 if successful, != 0 otherwise. The buffer is
+ * freed if an error occured.
+ */
+static uint8_t read_block(buffer_t *buf, uint16_t block) {
   /* Store the current sector, used for append */
   buf->pvt.d64.track  = buf->data[0];
   buf->pvt.d64.sector = buf->data[1];
+  buf->pvt.d64.blocks = block;
 
-  if (checked_read(buf->pvt.d64.part, buf->data[0], buf->data[1], buf->data, 256, ERROR_ILLEGAL_TS_LINK)) {
+  if (!prefetch_get(buf) &&
+      checked_read(buf->pvt.d64.part, buf->data[0], buf->data[1], buf->data, 256, ERROR_ILLEGAL_TS_LINK)) {
     free_buffer(buf);
     return 1;
   }
 
+  seekindex_add(buf, block, buf->pvt.d64.track, buf->pvt.d64.sector);
+
   buf->position = 2;
 
   if (buf->data[0] == 0) {
@@ -1078,22 +2054,107 @@ static uint8_t d64_read(buffer_t *buf) {
     buf->sendeoi  = 0;
   }
 
+  prefetch_request(buf);
+
   return 0;
 }
 
+/**
+ * d64_read - refill-callback used for reading
+ * @buf: target buffer
+ *
+ * This is the callback used as refill for files opened for reading.
+ */
+static uint8_t d64_read(buffer_t *buf) {
+  return read_block(buf, buf->pvt.d64.blocks + 1);
+}
+
 /**
  * d64_seek - seek-callback
  * @buf     : target buffer
  * @position: offset to seek to
  * @index   : offset within the record to seek to
  *
- * This is the function used as the seek callback. Since seeking
- * isn't supported for D64 files it just sets an error message
- * and returns 1.
+ * This is the function used as the seek callback for files opened
+ * for reading. The sector chain of the file is followed from the
+ * closest known block, which is either the current block, a block
+ * recorded in the seek index or the first block of the file.
+ * Seeking in files opened for writing is not supported.
+ * Returns 1 if an error occured, 0 otherwise.
  */
 static uint8_t d64_seek(buffer_t *buf, uint32_t position, uint8_t index) {
-  set_error(ERROR_SYNTAX_UNABLE);
-  return 1;
+  uint16_t target, block;
+  uint8_t  ts[2];
+
+  if (!buf->read) {
+    set_error(ERROR_SYNTAX_UNABLE);
+    return 1;
+  }
+
+  position += index;
+
+  /* no image holds 0xffff blocks, that number marks "beyond the end" */
+  if (position / 254 >= 0xffff)
+    goto beyond_end;
+
+  target = position / 254;
+
+  if (target != buf->pvt.d64.blocks) {
+    /* find the closest starting point */
+    ts[0] = buf->pvt.d64.first_track;
+    ts[1] = buf->pvt.d64.first_sector;
+    block = seekindex_lookup(buf, target, ts);
+
+    if (target > buf->pvt.d64.blocks && buf->pvt.d64.blocks >= block) {
+      /* continue from the current block */
+      block = buf->pvt.d64.blocks;
+      ts[0] = buf->pvt.d64.track;
+      ts[1] = buf->pvt.d64.sector;
+    } else if (block == 0) {
+      /* walking from the start, (re)build the index for this file */
+      seekindex_add(buf, 0, ts[0], ts[1]);
+    }
+
+    /* follow the chain */
+    while (block < target) {
+      if (checked_read(buf->pvt.d64.part, ts[0], ts[1], ts, 2, ERROR_ILLEGAL_TS_LINK)) {
+        free_buffer(buf);
+        return 1;
+      }
+
+      if (ts[0] == 0)
+        goto beyond_end;
+
+      block++;
+      seekindex_add(buf, block, ts[0], ts[1]);
+    }
+
+    buf->data[0] = ts[0];
+    buf->data[1] = ts[1];
+    if (read_block(buf, target))
+      return 1;
+  }
+
+  buf->position = position % 254 + 2;
+  if (buf->data[0] == 0 && buf->position > buf->lastused + 1)
+    goto beyond_end;
+
+  if (buf->position > buf->lastused)
+    buf->position = buf->lastused;
+
+  return 0;
+
+ beyond_end:
+  /* position is beyond the end of the file */
+  buf->data[0]  = 0;
+  buf->data[1]  = 2;
+  buf->data[2]  = 13;
+  buf->lastused = 2;
+  buf->position = 2;
+  buf->sendeoi  = 1;
+  buf->pvt.d64.blocks = 0xffff;
+  set_error(ERROR_RECORD_MISSING);
+  return 0;
 }
 
 /**
@@ -1133,11 +2194,11 @@ static uint8_t d64_write(buffer_t *buf) {
 
  storedata:
   /* Store data in the already-reserved sector */
-  if (image_write(buf->pvt.d64.part,
-                  sector_offset(buf->pvt.d64.part,
-                                buf->pvt.d64.track,
-                                buf->pvt.d64.sector),
-                  buf->data, 256, 1)) {
+  if (dxx_write(buf->pvt.d64.part,
+                sector_offset(buf->pvt.d64.part,
+                              buf->pvt.d64.track,
+                              buf->pvt.d64.sector),
+                buf->data, 256, 1)) {
     free_buffer(buf);
     return 1;
   }
@@ -1172,7 +2233,7 @@ static uint8_t d64_write_cleanup(buffer_t *buf) {
     return 1;
 
   /* Store data */
-  if (image_write(buf->pvt.d64.part, sector_offset(buf->pvt.d64.part,t,s), buf->data, 256, 1))
+  if (dxx_write(buf->pvt.d64.part, sector_offset(buf->pvt.d64.part,t,s), buf->data, 256, 1))
     return 1;
 
   /* Update directory entry */
@@ -1193,36 +2254,745 @@ static uint8_t d64_write_cleanup(buffer_t *buf) {
   return 0;
 }
 
-
 /* ------------------------------------------------------------------------- */
-/*  fileops-API                                                              */
+/*  REL files                                                                */
 /* ------------------------------------------------------------------------- */
 
-uint8_t d64_mount(path_t *path) {
-  uint8_t imagetype;
-  uint8_t part = path->part;
-  uint32_t fsize = partition[part].imagehandle.fsize;
+/**
+ * has_super_side - check if REL files use a super side sector
+ * @part: partition number
+ *
+ * This function returns true if REL files in the image on @part
+ * use a super side sector (1581 and CMD style) in addition to the
+ * side sectors.
+ */
+static uint8_t has_super_side(uint8_t part) {
+  uint8_t type = partition[part].imagetype & D64_TYPE_MASK;
 
-  switch (fsize) {
-  case 174848:
-    imagetype = D64_TYPE_D41;
-    memcpy_P(&partition[part].d64data, &d41param, sizeof(struct param_s));
-    break;
+  return type == D64_TYPE_D81 || type == D64_TYPE_DNP;
+}
 
-  case 175531:
-    imagetype = D64_TYPE_D41 | D64_HAS_ERRORINFO;
-    memcpy_P(&partition[part].d64data, &d41param, sizeof(struct param_s));
-    break;
+/**
+ * checked_read_at - read part of a sector after range-checking
+ * @part  : partition number
+ * @track : track number to be read
+ * @sector: sector number to be read
+ * @offset: offset of the data within the sector
+ * @buf   : pointer to where the data should be read to
+ * @len   : number of bytes to be read
+ *
+ * This function checks if the track and sector are within the
+ * limits for the image format and reads @len bytes starting at @offset
+ * if they are. Returns the same as checked_read.
+ */
+static uint8_t checked_read_at(uint8_t part, uint8_t track, uint8_t sector,
+                               uint8_t offset, uint8_t *buf, uint16_t len) {
+  if (track < 1 || track > get_param(part, LAST_TRACK) ||
+      sector >= sectors_per_track(part, track)) {
+    set_error_ts(ERROR_ILLEGAL_TS_LINK,track,sector);
+    return 2;
+  }
 
-  case 349696:
-    imagetype = D64_TYPE_D71;
-    memcpy_P(&partition[part].d64data, &d71param, sizeof(struct param_s));
-    break;
+  return sector_read(part, track, sector, offset, buf, len);
+}
 
-  case 351062:
-    imagetype = D64_TYPE_D71 | D64_HAS_ERRORINFO;
-    memcpy_P(&partition[part].d64data, &d71param, sizeof(struct param_s));
-    break;
+/**
+ * rel_side_sector - find a side sector of a REL file
+ * @buf  : buffer of the REL file
+ * @index: number of the side sector, counted over all groups
+ * @ts   : pointer to two bytes for the track/sector of the side sector
+ *
+ * This function looks up the track and sector of side sector @index
+ * using the (super) side sector. The result is cached in the file
+ * handle, so accessing records in the same side sector range needs no
+ * additional reads. Returns 0 if successful, != 0 otherwise.
+ */
+static uint8_t rel_side_sector(buffer_t *buf, uint16_t index, uint8_t *ts) {
+  d64fh_t *fh = &buf->pvt.d64;
+
+  if (fh->ss_index != index) {
+    uint8_t group = index / SS_PER_GROUP;
+    uint8_t num   = index % SS_PER_GROUP;
+
+    ts[0] = fh->side_track;
+    ts[1] = fh->side_sector;
+
+    if (has_super_side(fh->part)) {
+      if (checked_read_at(fh->part, ts[0], ts[1],
+                          SSS_OFS_GROUPS + 2 * group, ts, 2))
+        return 1;
+    } else if (group != 0) {
+      set_error(ERROR_FILE_TOO_LARGE);
+      return 1;
+    }
+
+    if (num != 0)
+      if (checked_read_at(fh->part, ts[0], ts[1],
+                          SS_OFS_GROUP + 2 * num, ts, 2))
+        return 1;
+
+    fh->ss_index  = index;
+    fh->ss_track  = ts[0];
+    fh->ss_sector = ts[1];
+  }
+
+  ts[0] = fh->ss_track;
+  ts[1] = fh->ss_sector;
+  return 0;
+}
+
+/**
+ * rel_block - find a data block of a REL file
+ * @buf  : buffer of the REL file
+ * @block: number of the data block
+ * @ts   : pointer to two bytes for the track/sector of the block
+ *
+ * This function looks up the track and sector of data block @block
+ * in the side sectors without following the data chain.
+ * Returns 0 if successful, != 0 otherwise.
+ */
+static uint8_t rel_block(buffer_t *buf, uint16_t block, uint8_t *ts) {
+  uint8_t part = buf->pvt.d64.part;
+
+  if (rel_side_sector(buf, block / SS_BLOCKS, ts))
+    return 1;
+
+  if (checked_read_at(part, ts[0], ts[1],
+                      SS_OFS_DATA + 2 * (block % SS_BLOCKS), ts, 2))
+    return 1;
+
+  if (ts[0] < 1 || ts[0] > get_param(part, LAST_TRACK) ||
+      ts[1] >= sectors_per_track(part, ts[0])) {
+    set_error_ts(ERROR_ILLEGAL_TS_LINK, ts[0], ts[1]);
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * rel_transfer - read or write the current record
+ * @buf  : buffer of the REL file
+ * @write: 0 to read the record into the buffer, 1 to write it
+ *
+ * This function transfers the record at file position buf->fptr
+ * between the image and buf->data+2. Records that span two data
+ * blocks are handled. Returns 0 if successful, != 0 otherwise.
+ */
+static uint8_t rel_transfer(buffer_t *buf, uint8_t write) {
+  uint8_t  part   = buf->pvt.d64.part;
+  uint16_t block  = buf->fptr / 254;
+  uint8_t  offset = buf->fptr % 254 + 2;
+  uint8_t  remain = buf->recordlen;
+  uint8_t *ptr    = buf->data + 2;
+  uint8_t  ts[2], len;
+
+  while (remain) {
+    if (rel_block(buf, block, ts))
+      return 1;
+
+    len = 256 - offset;
+    if (len > remain)
+      len = remain;
+
+    if (write) {
+      if (dxx_write(part, sector_offset(part, ts[0], ts[1]) + offset,
+                    ptr, len, 1))
+        return 1;
+    } else {
+      if (sector_read(part, ts[0], ts[1], offset, ptr, len))
+        return 1;
+    }
+
+    ptr    += len;
+    remain -= len;
+    block++;
+    offset  = 2;
+  }
+
+  return 0;
+}
+
+/**
+ * rel_format - fill part of a data block with empty records
+ * @data     : pointer to the data block
+ * @recordlen: record length of the file
+ * @start    : file position of the first data byte in the block
+ * @from     : first file position to be filled
+ * @to       : file position after the last byte to be filled
+ *
+ * This function fills the file positions @from to @to-1 in the data
+ * block at @data with empty records, i.e. 0xff at the start of each
+ * record and 0 everywhere else.
+ */
+static void rel_format(uint8_t *data, uint8_t recordlen, uint32_t start,
+                       uint32_t from, uint32_t to) {
+  uint8_t *ptr = data + 2 + (from - start);
+  uint8_t  i   = from % recordlen;
+
+  while (from++ < to) {
+    *ptr++ = (i == 0) ? 0xff : 0;
+    if (++i == recordlen)
+      i = 0;
+  }
+}
+
+/**
+ * rel_new_side_sector - add a side sector to a REL file
+ * @buf  : buffer of the REL file
+ * @index: number of the new side sector
+ * @ts   : track/sector of the first data block of the side sector
+ *
+ * This function allocates side sector @index, links it to the previous
+ * side sector and updates the side sector lists of its group or the
+ * super side sector. Returns 0 if successful, != 0 otherwise.
+ */
+static uint8_t rel_new_side_sector(buffer_t *buf, uint16_t index, uint8_t *ts) {
+  d64fh_t *fh  = &buf->pvt.d64;
+  uint8_t part = fh->part;
+  uint8_t num  = index % SS_PER_GROUP;
+  uint8_t res  = 1;
+  uint8_t prev[2], t, s, i;
+  buffer_t *sbuf;
+  uint8_t *work;
+
+  if (rel_side_sector(buf, index - 1, prev))
+    return 1;
+
+  sbuf = alloc_system_buffer();
+  if (sbuf == NULL)
+    return 1;
+
+  work = sbuf->data;
+
+  t = prev[0];
+  s = prev[1];
+  if (get_next_sector(part, &t, &s) ||
+      allocate_sector(part, t, s))
+    goto fail;
+
+  fh->blocks++;
+
+  memset(work, 0, 256);
+  work[1] = SS_OFS_DATA + 1;
+  work[SS_OFS_NUMBER]    = num;
+  work[SS_OFS_RECORDLEN] = buf->recordlen;
+
+  /* copy the side sector list of the group */
+  if (num != 0)
+    if (checked_read_at(part, prev[0], prev[1], SS_OFS_GROUP,
+                        work + SS_OFS_GROUP, 2 * SS_PER_GROUP))
+      goto fail;
+
+  work[SS_OFS_GROUP + 2 * num]     = t;
+  work[SS_OFS_GROUP + 2 * num + 1] = s;
+  work[SS_OFS_DATA]     = ts[0];
+  work[SS_OFS_DATA + 1] = ts[1];
+
+  if (dxx_write(part, sector_offset(part, t, s), work, 256, 0))
+    goto fail;
+
+  if (num != 0) {
+    /* update the list in the other side sectors of the group */
+    for (i = 0; i < num; i++)
+      if (dxx_write(part, sector_offset(part, work[SS_OFS_GROUP + 2 * i],
+                                        work[SS_OFS_GROUP + 2 * i + 1])
+                          + SS_OFS_GROUP,
+                    work + SS_OFS_GROUP, 2 * SS_PER_GROUP, 0))
+        goto fail;
+  } else {
+    /* first side sector of a new group, add it to the super side sector */
+    if (dxx_write(part, sector_offset(part, fh->side_track, fh->side_sector)
+                        + SSS_OFS_GROUPS + 2 * (index / SS_PER_GROUP),
+                  work + SS_OFS_GROUP, 2, 0))
+      goto fail;
+  }
+
+  /* link the previous side sector to the new one */
+  if (dxx_write(part, sector_offset(part, prev[0], prev[1]),
+                work + SS_OFS_GROUP + 2 * num, 2, 0))
+    goto fail;
+
+  fh->ss_index  = index;
+  fh->ss_track  = t;
+  fh->ss_sector = s;
+  res = 0;
+
+ fail:
+  free_buffer(sbuf);
+  return res;
+}
+
+/**
+ * rel_add_block - add a data block to the side sectors of a REL file
+ * @buf  : buffer of the REL file
+ * @block: number of the new data block
+ * @ts   : track/sector of the new data block
+ *
+ * This function stores the location of a new data block in the side
+ * sectors, creating a new side sector if required.
+ * Returns 0 if successful, != 0 otherwise.
+ */
+static uint8_t rel_add_block(buffer_t *buf, uint16_t block, uint8_t *ts) {
+  uint8_t part  = buf->pvt.d64.part;
+  uint8_t entry = SS_OFS_DATA + 2 * (block % SS_BLOCKS);
+  uint8_t used  = entry + 1;
+  uint8_t ss[2];
+  uint32_t offset;
+
+  if (block % SS_BLOCKS == 0)
+    return rel_new_side_sector(buf, block / SS_BLOCKS, ts);
+
+  if (rel_side_sector(buf, block / SS_BLOCKS, ss))
+    return 1;
+
+  offset = sector_offset(part, ss[0], ss[1]);
+
+  /* store the block and update the number of used bytes */
+  if (dxx_write(part, offset + entry, ts, 2, 0) ||
+      dxx_write(part, offset + 1, &used, 1, 0))
+    return 1;
+
+  return 0;
+}
+
+/**
+ * rel_extend - add records to a REL file
+ * @buf : buffer of the REL file
+ * @size: file position that must be covered by the file
+ *
+ * This function adds empty records to the end of the REL file until
+ * the file position @size is part of the file. Like a 1541, it then
+ * continues to fill the final data block with empty records.
+ * Returns 0 if successful, != 0 otherwise.
+ */
+static uint8_t rel_extend(buffer_t *buf, uint32_t size) {
+  d64fh_t *fh       = &buf->pvt.d64;
+  uint8_t part      = fh->part;
+  uint8_t recordlen = buf->recordlen;
+  uint8_t res       = 0;
+  uint8_t t, s, ts[2];
+  uint16_t blocks;
+  uint32_t newblocks, maxblocks, start, end;
+  buffer_t *work;
+
+  blocks    = (fh->relsize + 253) / 254;
+  newblocks = (size + 253) / 254;
+
+  if (has_super_side(part))
+    maxblocks = (uint32_t)SSS_GROUPS * SS_PER_GROUP * SS_BLOCKS;
+  else
+    maxblocks = SS_PER_GROUP * SS_BLOCKS;
+
+  if (newblocks > maxblocks) {
+    set_error(ERROR_FILE_TOO_LARGE);
+    return 1;
+  }
+
+  /* all records that fit into the final block */
+  end = newblocks * 254 / recordlen * recordlen;
+
+  work = alloc_system_buffer();
+  if (work == NULL)
+    return 1;
+
+  /* fill the rest of the current final block */
+  t = fh->track;
+  s = fh->sector;
+  if (checked_read(part, t, s, work->data, 256, ERROR_ILLEGAL_TS_LINK)) {
+    free_buffer(work);
+    return 1;
+  }
+
+  start = (uint32_t)(blocks - 1) * 254;
+  rel_format(work->data, recordlen, start, fh->relsize,
+             (end < start + 254) ? end : start + 254);
+
+  while (blocks < newblocks) {
+    ts[0] = t;
+    ts[1] = s;
+    if (get_next_sector(part, &ts[0], &ts[1]) ||
+        allocate_sector(part, ts[0], ts[1])) {
+      res = 1;
+      break;
+    }
+
+    if (rel_add_block(buf, blocks, ts)) {
+      free_sector(part, ts[0], ts[1]);
+      res = 1;
+      break;
+    }
+
+    fh->blocks++;
+
+    /* link the previous block to the new one */
+    work->data[0] = ts[0];
+    work->data[1] = ts[1];
+    if (dxx_write(part, sector_offset(part, t, s), work->data, 256, 0)) {
+      free_buffer(work);
+      return 1;
+    }
+
+    t = ts[0];
+    s = ts[1];
+    start += 254;
+    blocks++;
+
+    memset(work->data, 0, 256);
+    rel_format(work->data, recordlen, start, start,
+               (end < start + 254) ? end : start + 254);
+  }
+
+  if (res)
+    /* only keep the records that are complete in the final block */
+    end = (start + 254) / recordlen * recordlen;
+
+  /* finish the final block */
+  work->data[0] = 0;
+  work->data[1] = end - start + 1;
+  if (dxx_write(part, sector_offset(part, t, s), work->data, 256, 0))
+    res = 1;
+
+  free_buffer(work);
+
+  fh->track   = t;
+  fh->sector  = s;
+  fh->relsize = end;
+
+  /* update the block count in the directory entry */
+  if (read_entry(part, &fh->dh, entrybuf))
+    return 1;
+
+  entrybuf[DIR_OFS_SIZE_LOW] = fh->blocks & 0xff;
+  entrybuf[DIR_OFS_SIZE_HI]  = fh->blocks >> 8;
+
+  if (write_entry(part, &fh->dh, entrybuf, 1))
+    return 1;
+
+  return res;
+}
+
+/**
+ * rel_write_record - write the current record of a REL file
+ * @buf: buffer of the REL file
+ *
+ * This function writes the record in the buffer to the image, padding
+ * it with zeros and extending the file if required.
+ * Returns 0 if successful, != 0 otherwise.
+ */
+static uint8_t rel_write_record(buffer_t *buf) {
+  if (!buf->mustflush)
+    buf->lastused = buf->position - 1;
+
+  if (buf->recordlen > buf->lastused - 1)
+    memset(buf->data + buf->lastused + 1, 0, buf->recordlen - (buf->lastused - 1));
+
+  mark_buffer_clean(buf);
+  buf->mustflush = 0;
+
+  if (buf->fptr + buf->recordlen > buf->pvt.d64.relsize)
+    if (rel_extend(buf, buf->fptr + buf->recordlen))
+      return 1;
+
+  return rel_transfer(buf, 1);
+}
+
+/**
+ * d64_rel_seek - seek-callback for REL files
+ * @buf     : buffer of the REL file
+ * @position: offset of the record to seek to
+ * @index   : offset within the record to seek to
+ *
+ * This function writes the current record if it was changed and
+ * reads the record at @position, which is found through the side
+ * sectors. Returns 1 if an error occured, 0 otherwise.
+ */
+static uint8_t d64_rel_seek(buffer_t *buf, uint32_t position, uint8_t index) {
+  if (buf->dirty)
+    if (rel_write_record(buf)) {
+      free_buffer(buf);
+      return 1;
+    }
+
+  buf->fptr = position;
+
+  if (position + buf->recordlen <= buf->pvt.d64.relsize) {
+    if (rel_transfer(buf, 0)) {
+      free_buffer(buf);
+      return 1;
+    }
+
+    /* strip nulls from the end of the record */
+    buf->lastused = buf->recordlen + 1;
+    while (!buf->data[buf->lastused] && --(buf->lastused) > 1) ;
+  } else {
+    buf->data[2]  = 255;
+    buf->lastused = 2;
+    set_error(ERROR_RECORD_MISSING);
+  }
+
+  buf->sendeoi  = 1;
+  buf->position = index + 2;
+  if (index + 2 > buf->lastused)
+    buf->position = buf->lastused;
+
+  return 0;
+}
+
+/**
+ * d64_rel_sync - refill-callback for REL files
+ * @buf: buffer of the REL file
+ *
+ * This function moves to the next record of the REL file.
+ */
+static uint8_t d64_rel_sync(buffer_t *buf) {
+  return d64_rel_seek(buf, buf->fptr + buf->recordlen, 0);
+}
+
+/**
+ * d64_rel_cleanup - cleanup-callback for REL files
+ * @buf: buffer of the REL file
+ *
+ * This function writes the current record if it was changed.
+ */
+static uint8_t d64_rel_cleanup(buffer_t *buf) {
+  if (buf->dirty)
+    return rel_write_record(buf);
+
+  return 0;
+}
+
+/**
+ * rel_find_end - find the end of a REL file
+ * @buf: buffer of the REL file, side_track/side_sector must be set
+ *
+ * This function finds the last side sector and the last data block
+ * of a REL file and calculates the number of bytes in the file.
+ * The data area of @buf is used as a work area.
+ * Returns 0 if successful, != 0 otherwise.
+ */
+static uint8_t rel_find_end(buffer_t *buf) {
+  d64fh_t *fh   = &buf->pvt.d64;
+  uint8_t *data = buf->data;
+  uint8_t  t    = fh->side_track;
+  uint8_t  s    = fh->side_sector;
+  uint16_t index = 0;
+  uint8_t  i;
+
+  if (has_super_side(fh->part)) {
+    /* find the last group in the super side sector */
+    if (checked_read(fh->part, t, s, data, 256, ERROR_ILLEGAL_TS_LINK))
+      return 1;
+
+    for (i = SSS_GROUPS - 1; i > 0 && data[SSS_OFS_GROUPS + 2 * i] == 0; i--) ;
+
+    t = data[SSS_OFS_GROUPS + 2 * i];
+    s = data[SSS_OFS_GROUPS + 2 * i + 1];
+    index = i * SS_PER_GROUP;
+  }
+
+  /* find the last side sector in the group */
+  if (checked_read(fh->part, t, s, data, 256, ERROR_ILLEGAL_TS_LINK))
+    return 1;
+
+  for (i = SS_PER_GROUP - 1; i > 0 && data[SS_OFS_GROUP + 2 * i] == 0; i--) ;
+
+  if (i != 0) {
+    t = data[SS_OFS_GROUP + 2 * i];
+    s = data[SS_OFS_GROUP + 2 * i + 1];
+    index += i;
+
+    if (checked_read(fh->part, t, s, data, 256, ERROR_ILLEGAL_TS_LINK))
+      return 1;
+  }
+
+  fh->ss_index  = index;
+  fh->ss_track  = t;
+  fh->ss_sector = s;
+
+  /* find the last data block in the side sector */
+  for (i = SS_BLOCKS; i > 0 && data[SS_OFS_DATA + 2 * (i-1)] == 0; i--) ;
+
+  if (i == 0) {
+    set_error_ts(ERROR_ILLEGAL_TS_LINK, t, s);
+    return 1;
+  }
+
+  fh->track  = data[SS_OFS_DATA + 2 * (i-1)];
+  fh->sector = data[SS_OFS_DATA + 2 * (i-1) + 1];
+
+  /* read the number of bytes in the last data block */
+  if (checked_read(fh->part, fh->track, fh->sector, data, 2, ERROR_ILLEGAL_TS_LINK))
+    return 1;
+
+  if (data[0] != 0)
+    data[1] = 255;
+
+  fh->relsize = (uint32_t)(index * SS_BLOCKS + i - 1) * 254 + data[1] - 1;
+
+  return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/*  Mount state cache                                                        */
+/* ------------------------------------------------------------------------- */
+
+#ifdef CONFIG_MOUNT_CACHE
+/**
+ * d64_mountcache_invalidate - forget the state of all unmounted images
+ *
+ * This function must be called whenever an image file may have been
+ * changed outside of d64ops, e.g. by writing to or deleting a file
+ * on FAT.
+ */
+void d64_mountcache_invalidate(void) {
+  for (uint8_t i = 0; i < CONFIG_MOUNT_CACHE; i++)
+    mountcache[i].part = 255;
+}
+
+/**
+ * mountcache_store - save the cached state of an image before unmounting
+ * @part: partition number
+ *
+ * This function copies the current BAM sector and directory sector of
+ * the image mounted on @part into the least-recently stored entry of
+ * the mount cache, keyed by start cluster and size of the image file
+ * and the partition it is stored on. Nothing is stored while the same
+ * image is still mounted on another partition or image slot, because
+ * it can be changed there. Every mount takes the entry of its image out
+ * of the cache, so an entry never describes an image that is in use.
+ */
+static void mountcache_store(uint8_t part) {
+  FIL     *fh    = image_handle(part);
+  uint8_t  owner = image_slot_owner(part);
+  uint8_t  entry = 0;
+  uint8_t  i;
+
+  if (fh->org_clust == 0)
+    return;
+
+  for (i = 0; i < PARTITION_COUNT; i++)
+    if (i != part && partition[i].fop == &d64ops &&
+        image_slot_owner(i) == owner &&
+        image_handle(i)->org_clust == fh->org_clust)
+      return;
+
+  /* prefer an unused entry, otherwise replace the oldest one */
+  for (i = 0; i < CONFIG_MOUNT_CACHE; i++) {
+    if (mountcache[i].part == 255) {
+      entry = i;
+      break;
+    }
+
+    if ((uint8_t)(mountstamp - mountcache[i].stamp) >
+        (uint8_t)(mountstamp - mountcache[entry].stamp))
+      entry = i;
+  }
+
+  mountcache[entry].part       = owner;
+  mountcache[entry].stamp      = mountstamp++;
+  mountcache[entry].cluster    = fh->org_clust;
+  mountcache[entry].fsize      = fh->fsize;
+  mountcache[entry].bam_ts[0]  = 0;
+
+  /* BAM sector - only if its contents are on disk */
+  if (bam_buffer && bam_buffer->pvt.bam.part == part &&
+      !bam_buffer->cleanup(bam_buffer)) {
+    mountcache[entry].bam_ts[0] = bam_buffer->pvt.bam.track;
+    mountcache[entry].bam_ts[1] = bam_buffer->pvt.bam.sector;
+    memcpy(mountcache[entry].bam, bam_buffer->data, 256);
+  }
+
+#ifdef CONFIG_DIR_CACHE
+  mountcache[entry].dir_ts[0] = 0;
+
+  if (dircache.part == part) {
+    mountcache[entry].dir_ts[0] = dircache.track;
+    mountcache[entry].dir_ts[1] = dircache.sector;
+    memcpy(mountcache[entry].dir, dircache.data, 256);
+  }
+#endif
+}
+
+/**
+ * mountcache_restore - restore the cached state of an image after mounting
+ * @part: partition number
+ *
+ * This function checks if the mount cache has an entry for the image
+ * that was just mounted on @part and loads its BAM and directory sector
+ * into the BAM buffer and directory cache. The entry is released,
+ * it is stored again when the image is unmounted.
+ */
+static void mountcache_restore(uint8_t part) {
+  FIL     *fh    = image_handle(part);
+  uint8_t  owner = image_slot_owner(part);
+
+  for (uint8_t i = 0; i < CONFIG_MOUNT_CACHE; i++) {
+    if (mountcache[i].part    != owner         ||
+        mountcache[i].cluster != fh->org_clust ||
+        mountcache[i].fsize   != fh->fsize)
+      continue;
+
+    mountcache[i].part = 255;
+
+    /* keep the BAM of another partition if there is an unused buffer */
+    if (bam_buffer2 && bam_buffer2->pvt.bam.part == 255)
+      bam_buffer_swap();
+
+    /* the BAM buffer may still hold unwritten data of another partition */
+    if (mountcache[i].bam_ts[0] != 0 && !bam_buffer->cleanup(bam_buffer)) {
+      bam_buffer->pvt.bam.part   = part;
+      bam_buffer->pvt.bam.track  = mountcache[i].bam_ts[0];
+      bam_buffer->pvt.bam.sector = mountcache[i].bam_ts[1];
+      memcpy(bam_buffer->data, mountcache[i].bam, 256);
+    }
+
+#ifdef CONFIG_DIR_CACHE
+    if (mountcache[i].dir_ts[0] != 0 && !dircache_flush()) {
+      dircache.part   = part;
+      dircache.track  = mountcache[i].dir_ts[0];
+      dircache.sector = mountcache[i].dir_ts[1];
+      memcpy(dircache.data, mountcache[i].dir, 256);
+    }
+#endif
+    return;
+  }
+}
+
+#else
+#  define mountcache_store(part)   do {} while (0)
+#  define mountcache_restore(part) do {} while (0)
+#endif
+
+/* ------------------------------------------------------------------------- */
+/*  fileops-API                                                              */
+/* ------------------------------------------------------------------------- */
+
+uint8_t d64_mount(path_t *path) {
+  uint8_t imagetype;
+  uint8_t part = path->part;
+  uint32_t fsize = image_handle(part)->fsize;
+
+  switch (fsize) {
+  case 174848:
+    imagetype = D64_TYPE_D41;
+    memcpy_P(&partition[part].d64data, &d41param, sizeof(struct param_s));
+    break;
+
+  case 175531:
+    imagetype = D64_TYPE_D41 | D64_HAS_ERRORINFO;
+    memcpy_P(&partition[part].d64data, &d41param, sizeof(struct param_s));
+    break;
+
+  case 349696:
+    imagetype = D64_TYPE_D71;
+    memcpy_P(&partition[part].d64data, &d71param, sizeof(struct param_s));
+    break;
+
+  case 351062:
+    imagetype = D64_TYPE_D71 | D64_HAS_ERRORINFO;
+    memcpy_P(&partition[part].d64data, &d71param, sizeof(struct param_s));
+    break;
 
   case 819200:
     imagetype = D64_TYPE_D81;
@@ -1260,6 +3030,13 @@ uint8_t d64_mount(path_t *path) {
     /* Invalidate error cache */
     errorcache.part = 255;
 
+  trackcache_invalidate();
+  dircache_invalidate();
+  dirindex_invalidate();
+  seekindex_invalidate();
+  d64_prefetch_cancel();
+  mountcache_restore(part);
+
   return 0;
 }
 
@@ -1272,9 +3049,8 @@ static uint8_t d64_opendir(dh_t *dh, path_t *path) {
   if (partition[path->part].imagetype == D64_TYPE_DNP) {
     /* Read the real first directory sector from the header sector */
     uint8_t tmp[2];
-    if (image_read(path->part,
-                   sector_offset(path->part, dh->dir.d64.track, dh->dir.d64.sector),
-                   tmp, 2))
+    if (sector_read(path->part, dh->dir.d64.track, dh->dir.d64.sector,
+                    0, tmp, 2))
       return 1;
 
     dh->dir.d64.track  = tmp[0];
@@ -1416,14 +3192,16 @@ static void d64_open_read(path_t *path, cbmdirent_t *dent, buffer_t *buf) {
   buf->data[0] = entrybuf[DIR_OFS_TRACK];
   buf->data[1] = entrybuf[DIR_OFS_SECTOR];
 
-  buf->pvt.d64.part = path->part;
+  buf->pvt.d64.part         = path->part;
+  buf->pvt.d64.first_track  = buf->data[0];
+  buf->pvt.d64.first_sector = buf->data[1];
 
   buf->read    = 1;
   buf->refill  = d64_read;
   buf->seek    = d64_seek;
   stick_buffer(buf);
 
-  buf->refill(buf);
+  read_block(buf, 0);
 }
 
 static void d64_open_write(path_t *path, cbmdirent_t *dent, uint8_t type, buffer_t *buf, uint8_t append) {
@@ -1431,7 +3209,7 @@ static void d64_open_write(path_t *path, cbmdirent_t *dent, uint8_t type, buffer
   uint8_t *ptr;
 
   /* Check for read-only image file */
-  if (!(partition[path->part].imagehandle.flag & FA_WRITE)) {
+  if (!(image_handle(path->part)->flag & FA_WRITE)) {
     set_error(ERROR_WRITE_PROTECT);
     return;
   }
@@ -1513,8 +3291,171 @@ static void d64_open_write(path_t *path, cbmdirent_t *dent, uint8_t type, buffer
   stick_buffer(buf);
 }
 
+/**
+ * d64_open_rel - open or create a REL file
+ * @path  : path of the file
+ * @dent  : name of the file
+ * @buf   : buffer to be used
+ * @length: record length
+ * @mode  : 0 to create a new file, != 0 to open an existing file
+ *
+ * This function opens a REL file in a disk image and reads its first
+ * record. New files are created with one data block of empty records,
+ * a side sector and, for D81/DNP, a super side sector.
+ */
 static void d64_open_rel(path_t *path, cbmdirent_t *dent, buffer_t *buf, uint8_t length, uint8_t mode) {
-  set_error(ERROR_SYNTAX_UNABLE);
+  d64fh_t *fh  = &buf->pvt.d64;
+  uint8_t part = path->part;
+  uint8_t oldlength;
+  uint8_t data[2], side[2], super[2];
+
+  fh->part = part;
+
+  if (!mode) {
+    /* Create a new file */
+    dh_t dh;
+    uint8_t *ptr, *name;
+    uint8_t end;
+
+    if (!(image_handle(part)->flag & FA_WRITE)) {
+      set_error(ERROR_WRITE_PROTECT);
+      return;
+    }
+
+    if (length == 0 || length == 255) {
+      set_error(ERROR_SYNTAX_UNABLE);
+      return;
+    }
+
+    if (find_empty_entry(path, &dh))
+      return;
+
+    /* Allocate the first data block and the side sector(s) */
+    if (get_first_sector(part, &data[0], &data[1]) ||
+        allocate_sector(part, data[0], data[1]))
+      return;
+
+    side[0] = data[0];
+    side[1] = data[1];
+    if (get_next_sector(part, &side[0], &side[1]) ||
+        allocate_sector(part, side[0], side[1]))
+      goto free_data;
+
+    fh->blocks = 2;
+    fh->side_track  = side[0];
+    fh->side_sector = side[1];
+
+    if (has_super_side(part)) {
+      super[0] = side[0];
+      super[1] = side[1];
+      if (get_next_sector(part, &super[0], &super[1]) ||
+          allocate_sector(part, super[0], super[1]))
+        goto free_side;
+
+      fh->blocks++;
+      fh->side_track  = super[0];
+      fh->side_sector = super[1];
+
+      /* Write the super side sector */
+      memset(buf->data, 0, 256);
+      buf->data[0] = side[0];
+      buf->data[1] = side[1];
+      buf->data[2] = SSS_MARKER;
+      buf->data[SSS_OFS_GROUPS]     = side[0];
+      buf->data[SSS_OFS_GROUPS + 1] = side[1];
+      if (dxx_write(part, sector_offset(part, super[0], super[1]), buf->data, 256, 0))
+        goto free_super;
+    }
+
+    /* Write the side sector */
+    memset(buf->data, 0, 256);
+    buf->data[1] = SS_OFS_DATA + 1;
+    buf->data[SS_OFS_RECORDLEN]  = length;
+    buf->data[SS_OFS_GROUP]      = side[0];
+    buf->data[SS_OFS_GROUP + 1]  = side[1];
+    buf->data[SS_OFS_DATA]       = data[0];
+    buf->data[SS_OFS_DATA + 1]   = data[1];
+    if (dxx_write(part, sector_offset(part, side[0], side[1]), buf->data, 256, 0))
+      goto free_super;
+
+    /* Write the first data block filled with empty records */
+    end = 254 / length * length;
+    memset(buf->data, 0, 256);
+    rel_format(buf->data, length, 0, 0, end);
+    buf->data[1] = end + 1;
+    if (dxx_write(part, sector_offset(part, data[0], data[1]), buf->data, 256, 0))
+      goto free_super;
+
+    /* Create the directory entry */
+    name = dent->name;
+    memset(entrybuf+2, 0, sizeof(entrybuf)-2);  /* Don't overwrite the link pointer! */
+    memset(entrybuf+DIR_OFS_FILE_NAME, 0xa0, CBM_NAME_LENGTH);
+    ptr = entrybuf+DIR_OFS_FILE_NAME;
+    while (*name) *ptr++ = *name++;
+
+    entrybuf[DIR_OFS_FILE_TYPE]   = TYPE_REL | FLAG_SPLAT;
+    entrybuf[DIR_OFS_TRACK]       = data[0];
+    entrybuf[DIR_OFS_SECTOR]      = data[1];
+    entrybuf[DIR_OFS_SIDE_TRACK]  = fh->side_track;
+    entrybuf[DIR_OFS_SIDE_SECTOR] = fh->side_sector;
+    entrybuf[DIR_OFS_RECORD_LEN]  = length;
+    entrybuf[DIR_OFS_SIZE_LOW]    = fh->blocks;
+    update_timestamp(entrybuf);
+    if (write_entry(part, &dh.dir.d64, entrybuf, 1))
+      goto free_super;
+
+    fh->dh        = dh.dir.d64;
+    fh->track     = data[0];
+    fh->sector    = data[1];
+    fh->ss_index  = 0;
+    fh->ss_track  = side[0];
+    fh->ss_sector = side[1];
+    fh->relsize   = end;
+    oldlength     = length;
+
+  } else {
+    /* Open an existing file */
+    if (read_entry(part, &dent->pvt.dxx.dh, entrybuf))
+      return;
+
+    oldlength = entrybuf[DIR_OFS_RECORD_LEN];
+    if (!length)
+      length = oldlength;
+
+    fh->dh          = dent->pvt.dxx.dh;
+    fh->blocks      = entrybuf[DIR_OFS_SIZE_LOW] + 256*entrybuf[DIR_OFS_SIZE_HI];
+    fh->side_track  = entrybuf[DIR_OFS_SIDE_TRACK];
+    fh->side_sector = entrybuf[DIR_OFS_SIDE_SECTOR];
+
+    if (oldlength == 0 || rel_find_end(buf)) {
+      if (!current_error)
+        set_error(ERROR_SYNTAX_UNABLE);
+      return;
+    }
+  }
+
+  buf->recordlen = length;
+  mark_write_buffer(buf);
+  buf->read      = 1;
+  buf->cleanup   = d64_rel_cleanup;
+  buf->refill    = d64_rel_sync;
+  buf->seek      = d64_rel_seek;
+
+  stick_buffer(buf);
+
+  /* read the first record */
+  if (!d64_rel_seek(buf, 0, 0) && length != oldlength)
+    set_error(ERROR_RECORD_MISSING);
+  return;
+
+  /* Creating the file failed, return its sectors to the BAM */
+ free_super:
+  if (has_super_side(part))
+    free_sector(part, super[0], super[1]);
+ free_side:
+  free_sector(part, side[0], side[1]);
+ free_data:
+  free_sector(part, data[0], data[1]);
 }
 
 static uint8_t d64_delete(path_t *path, cbmdirent_t *dent) {
@@ -1524,6 +3465,28 @@ static uint8_t d64_delete(path_t *path, cbmdirent_t *dent) {
   if (read_entry(path->part, &dent->pvt.dxx.dh, entrybuf))
     return 255;
 
+  /* Free the side sectors of REL files */
+  if ((entrybuf[DIR_OFS_FILE_TYPE] & TYPE_MASK) == TYPE_REL &&
+      entrybuf[DIR_OFS_SIDE_TRACK] != 0) {
+    linkbuf[0] = entrybuf[DIR_OFS_SIDE_TRACK];
+    linkbuf[1] = entrybuf[DIR_OFS_SIDE_SECTOR];
+
+    if (has_super_side(path->part)) {
+      /* the super side sector links to the first side sector */
+      free_sector(path->part, linkbuf[0], linkbuf[1]);
+
+      if (checked_read(path->part, linkbuf[0], linkbuf[1], linkbuf, 2, ERROR_ILLEGAL_TS_LINK))
+        return 255;
+    }
+
+    do {
+      free_sector(path->part, linkbuf[0], linkbuf[1]);
+
+      if (checked_read(path->part, linkbuf[0], linkbuf[1], linkbuf, 2, ERROR_ILLEGAL_TS_LINK))
+        return 255;
+    } while (linkbuf[0]);
+  }
+
   /* Free the sector chain in the BAM */
   linkbuf[0] = entrybuf[DIR_OFS_TRACK];
   linkbuf[1] = entrybuf[DIR_OFS_SECTOR];
@@ -1536,8 +3499,21 @@ static uint8_t d64_delete(path_t *path, cbmdirent_t *dent) {
   } while (linkbuf[0]);
 
   /* Clear directory entry */
+#if defined(CONFIG_SCRATCH_BATCH) && defined(CONFIG_DIR_CACHE)
+  if ((globalflags & SCRATCH_BATCH) &&
+      dircache.part   == path->part &&
+      dircache.track  == dent->pvt.dxx.dh.track &&
+      dircache.sector == dent->pvt.dxx.dh.sector) {
+    /* written once per sector by dircache_flush */
+    dircache.data[dent->pvt.dxx.dh.entry * 32 + DIR_OFS_FILE_TYPE] = 0;
+    dircache.dirty = 1;
+    return 1;
+  }
+#endif
+
   entrybuf[DIR_OFS_FILE_TYPE] = 0;
-  if (write_entry(path->part, &dent->pvt.dxx.dh, entrybuf, 1))
+  if (write_entry(path->part, &dent->pvt.dxx.dh, entrybuf,
+                  !(globalflags & SCRATCH_BATCH)))
     return 255;
 
   return 1;
@@ -1552,7 +3528,7 @@ static void d64_write_sector(buffer_t *buf, uint8_t part, uint8_t track, uint8_t
       sector >= sectors_per_track(part, track)) {
     set_error_ts(ERROR_ILLEGAL_TS_COMMAND,track,sector);
   } else
-    image_write(part, sector_offset(part,track,sector), buf->data, 256, 1);
+    dxx_write(part, sector_offset(part,track,sector), buf->data, 256, 1);
 }
 
 static void d64_rename(path_t *path, cbmdirent_t *dent, uint8_t *newname) {
@@ -1733,17 +3709,17 @@ static void d64_mkdir(path_t *path, uint8_t *dirname) {
   *ptr++ = 'H';
 
   /* Write directory header sector */
-  if (image_write(path->part,
-                  sector_offset(path->part, h_track, h_sector),
-                  buf->data, 256, 0))
+  if (dxx_write(path->part,
+                sector_offset(path->part, h_track, h_sector),
+                buf->data, 256, 0))
     return;
 
   /* Create empty directory sector */
   memset(buf->data, 0, 256);
   buf->data[1] = 0xff;
-  if (image_write(path->part,
-                  sector_offset(path->part, d_track, d_sector),
-                  buf->data, 256, 0))
+  if (dxx_write(path->part,
+                sector_offset(path->part, d_track, d_sector),
+                buf->data, 256, 0))
     return;
 
   /* Create the directory entry */
@@ -1760,8 +3736,8 @@ static void d64_mkdir(path_t *path, uint8_t *dirname) {
   entrybuf[DIR_OFS_SIZE_LOW]  = 2;
   update_timestamp(entrybuf);
 
-  image_write(path->part, sector_offset(path->part, dh.dir.d64.track, dh.dir.d64.sector)
-                          + dh.dir.d64.entry * 32 + 2, entrybuf+2, 30, 1);
+  dxx_write(path->part, sector_offset(path->part, dh.dir.d64.track, dh.dir.d64.sector)
+                        + dh.dir.d64.entry * 32 + 2, entrybuf+2, 30, 1);
 }
 
 /**
@@ -1776,37 +3752,132 @@ void d64_invalidate(void) {
   free_buffer(bam_buffer2);
   bam_buffer2  = NULL;
   bam_refcount = 0;
+  trackcache_invalidate();
+  dircache_invalidate();
+  dirindex_invalidate();
+  seekindex_invalidate();
+#ifdef CONFIG_CHAIN_PREFETCH
+  free_buffer(prefetch.buf);
+  prefetch.buf = NULL;
+#endif
+#ifdef CONFIG_IMAGE_SYNC_SECTORS
+  imagesync.part = 255;
+#endif
+  d64_mountcache_invalidate();
 }
 
-/**
- * d64_unmount - unmount disk image
- * @part: partition number
- *
- * This function in called on image unmount and handles
- * refcounting for the BAM buffers.
- */
-void d64_unmount(uint8_t part) {
-  /* invalidate BAM buffers that point to the current partition */
-  if (bam_buffer) {
-    bam_buffer->cleanup(bam_buffer);
-    if (bam_buffer->pvt.bam.part == part)
-      bam_buffer->pvt.bam.part = 255;
+/**
+ * d64_unmount - unmount disk image
+ * @part: partition number
+ *
+ * This function in called on image unmount and handles
+ * refcounting for the BAM buffers.
+ */
+void d64_unmount(uint8_t part) {
+  dircache_flush();
+  mountcache_store(part);
+  trackcache_invalidate();
+  dircache_invalidate();
+  dirindex_invalidate();
+  seekindex_invalidate();
+  d64_prefetch_cancel();
+
+  /* invalidate BAM buffers that point to the current partition */
+  if (bam_buffer) {
+    bam_buffer->cleanup(bam_buffer);
+    if (bam_buffer->pvt.bam.part == part)
+      bam_buffer->pvt.bam.part = 255;
+  }
+
+  if (bam_buffer2) {
+    bam_buffer2->cleanup(bam_buffer2);
+    if (bam_buffer2->pvt.bam.part == part)
+      bam_buffer2->pvt.bam.part = 255;
+  }
+
+  /* decrease BAM buffer refcounter - it can never be zero while a Dxx is mounted*/
+  if (--bam_refcount) {
+    free_buffer(bam_buffer);
+    free_buffer(bam_buffer2);
+    bam_buffer  = NULL;
+    bam_buffer2 = NULL;
+  }
+
+#ifdef CONFIG_IMAGE_SYNC_SECTORS
+  /* closing the image file syncs it */
+  if (imagesync.part == part)
+    imagesync.part = 255;
+#endif
+}
+
+#ifdef CONFIG_IMAGE_SLOTS
+/**
+ * d64_image_busy - check for open files in an image
+ * @part: partition number
+ *
+ * This function returns 1 if any buffer accesses a file in the disk
+ * image mounted on @part or 0 if the image can be unmounted without
+ * disturbing an open file.
+ */
+uint8_t d64_image_busy(uint8_t part) {
+  for (uint8_t i = 0; i < CONFIG_BUFFER_COUNT; i++) {
+    buffer_t *buf = buffers + i;
+
+    if (buf->allocated && buf->pvt.d64.part == part &&
+        (buf->refill == d64_read || buf->refill == d64_write ||
+         buf->refill == d64_rel_sync))
+      return 1;
+  }
+
+  return 0;
+}
+#endif
+
+#ifdef CONFIG_READ_BENCHMARK
+/**
+ * d64_read_benchmark - measure the speed of sector reads
+ * @part: partition number
+ *
+ * This function reads every sector of the image mounted on @part with
+ * checked_read and returns the average number of CPU cycles per read,
+ * limited to 65535. Returns 0 if no Dxx image is mounted on @part or
+ * if a read failed.
+ */
+uint16_t d64_read_benchmark(uint8_t part) {
+  buffer_t *buf;
+  uint32_t  cycles = 0;
+  uint16_t  count  = 0;
+
+  if (partition[part].fop != &d64ops)
+    return 0;
+
+  buf = alloc_buffer();
+  if (buf == NULL)
+    return 0;
+
+  for (uint16_t t = 1; t <= get_param(part, LAST_TRACK); t++) {
+    for (uint16_t s = 0; s < sectors_per_track(part, t); s++) {
+      uint32_t start = cycle_counter();
+
+      if (checked_read(part, t, s, buf->data, 256, ERROR_ILLEGAL_TS_LINK)) {
+        free_buffer(buf);
+        return 0;
+      }
+
+      cycles += cycle_counter() - start;
+      count++;
+    }
   }
 
-  if (bam_buffer2) {
-    bam_buffer2->cleanup(bam_buffer2);
-    if (bam_buffer2->pvt.bam.part == part)
-      bam_buffer2->pvt.bam.part = 255;
-  }
+  free_buffer(buf);
 
-  /* decrease BAM buffer refcounter - it can never be zero while a Dxx is mounted*/
-  if (--bam_refcount) {
-    free_buffer(bam_buffer);
-    free_buffer(bam_buffer2);
-    bam_buffer  = NULL;
-    bam_buffer2 = NULL;
-  }
+  cycles /= count;
+  if (cycles > 65535)
+    return 65535;
+  else
+    return cycles;
 }
+#endif
 
 
 /* ------------------------------------------------------------------------- */
@@ -1903,8 +3974,8 @@ static void format_d81_image(uint8_t part, buffer_t *buf, uint8_t *name, uint8_t
   format_copy_label(part, buf->data, name, idbuf);
 
   /* write 40/0 */
-  if (image_write(part, /*sector_offset(part, 40, 0)*/ (40-1)*40*256L,
-                  buf->data, 256, 0))
+  if (dxx_write(part, /*sector_offset(part, 40, 0)*/ (40-1)*40*256L,
+                buf->data, 256, 0))
     return;
 
   clear_dir_sector(part, D81_BAM_TRACK, 3, buf->data);
@@ -1933,18 +4004,93 @@ static void format_dnp_image(uint8_t part, buffer_t *buf, uint8_t *name, uint8_t
   buf->data[DNP_DIRHEADER_ROOTHDR_SECTOR] = 1;
 
   /* write 1/1 */
-  if (image_write(part, /*sector_offset(part, 1, 1)*/ 256,
-                  buf->data, 256, 0))
+  if (dxx_write(part, /*sector_offset(part, 1, 1)*/ 256,
+                buf->data, 256, 0))
     return;
 
   clear_dir_sector(part, 1, DNP_ROOTDIR_SECTOR, buf->data);
 }
 
+/**
+ * format_clear_sectors - fill consecutive sectors with zeroes
+ * @part : partition number
+ * @first: LBA of the first sector to clear
+ * @count: number of sectors to clear
+ * @zero : 256-byte buffer filled with zeroes
+ *
+ * This function writes zeroes to @count sectors of the image starting
+ * at @first. If the track cache is available it is borrowed as a larger
+ * source of zeroes, so a single request covers many sectors.
+ * Returns 0 if successful, 1 on error.
+ */
+static uint8_t format_clear_sectors(uint8_t part, uint16_t first,
+                                    uint16_t count, uint8_t *zero) {
+  uint8_t chunk = 1;
+
+#ifdef CONFIG_TRACK_CACHE
+  if (TRACKCACHE_SECTORS != 0) {
+    trackcache_invalidate();
+    memset(trackcache_data, 0, TRACKCACHE_SECTORS * 256);
+    zero  = trackcache_data;
+    chunk = TRACKCACHE_SECTORS;
+  }
+#endif
+
+  while (count) {
+    uint8_t n = chunk;
+
+    if (count < n)
+      n = count;
+
+    if (dxx_write(part, 256L * first, zero, n * 256, 0))
+      return 1;
+
+    first += n;
+    count -= n;
+  }
+
+  return 0;
+}
+
+/**
+ * format_free_track - mark all sectors of a track as free
+ * @part : partition number
+ * @track: track number
+ *
+ * This function sets the BAM entry of the given track to "all free"
+ * with direct writes to the bitfield and counter instead of freeing
+ * every single sector.
+ * Returns 0 if successful, 1 on error.
+ */
+static uint8_t format_free_track(uint8_t part, uint8_t track) {
+  uint16_t count = sectors_per_track(part, track);
+  uint8_t *ptr;
+
+  if (move_bam_window(part, track, BAM_BITFIELD, &ptr))
+    return 1;
+
+  bam_buffer->mustflush = 1;
+  memset(ptr, 0xff, count / 8);
+
+  if (partition[part].imagetype == D64_TYPE_DNP)
+    /* always 256 sectors, no counter */
+    return 0;
+
+  if (count & 7)
+    ptr[count / 8] |= (1 << (count & 7)) - 1;
+
+  if (move_bam_window(part, track, BAM_FREECOUNT, &ptr))
+    return 1;
+
+  *ptr = count;
+  bam_buffer->mustflush = 1;
+  return 0;
+}
+
 static void d64_format(uint8_t part, uint8_t *name, uint8_t *id) {
   buffer_t *buf;
   uint8_t  idbuf[5];
   uint16_t t;
-  uint16_t  s;
 
   /* allow format on DNP only when in the root directory */
   if (partition[part].imagetype == D64_TYPE_DNP &&
@@ -1971,13 +4117,10 @@ static void d64_format(uint8_t part, uint8_t *name, uint8_t *id) {
 
   if (id != NULL) {
     /* Clear the data area of the disk image */
-    for (t=1; t<=get_param(part, LAST_TRACK); t++) {
-      for (s=0; s<sectors_per_track(part, t); s++) {
-        if (image_write(part, sector_offset(part, t, s),
-                        buf->data, 256, 0))
-          return;
-      }
-    }
+    t = get_param(part, LAST_TRACK);
+    if (format_clear_sectors(part, 0, sector_lba(part, t, 0) +
+                             sectors_per_track(part, t), buf->data))
+      return;
 
     /* Copy the new ID into the buffer */
     idbuf[0] = id[0];
@@ -1994,19 +4137,16 @@ static void d64_format(uint8_t part, uint8_t *name, uint8_t *id) {
     /* clear the entire directory track */
     /* This is not accurate, but I do not care. */
     t = get_param(part, DIR_TRACK);
-    for (s=0; s < sectors_per_track(part, t); s++) {
-      if (image_write(part, sector_offset(part, t, s),
-                      buf->data, 256, 0))
-        return;
-    }
+    if (format_clear_sectors(part, sector_lba(part, t, 0),
+                             sectors_per_track(part, t), buf->data))
+      return;
   }
   idbuf[2] = 0xa0;
 
   /* Mark all sectors as free */
-  for (t=1; t<=get_param(part, LAST_TRACK); t++) {
-    for (s=0; s<sectors_per_track(part, t); s++)
-      free_sector(part,t,s);
-  }
+  for (t=1; t<=get_param(part, LAST_TRACK); t++)
+    if (format_free_track(part, t))
+      return;
 
   /* call imagetype-specific format function */
   partition[part].d64data.format_function(part, buf, name, idbuf);
@@ -2015,6 +4155,433 @@ static void d64_format(uint8_t part, uint8_t *name, uint8_t *id) {
 }
 
 
+/* ------------------------------------------------------------------------- */
+/*  Validate                                                                 */
+/* ------------------------------------------------------------------------- */
+
+#ifdef CONFIG_VALIDATE
+/* The sector map and the read area share the track cache memory */
+static struct {
+  uint8_t *map;      /* one bit per LBA sector, set if in use */
+  uint8_t *data;     /* read area for sectors of the image */
+  uint8_t  size;     /* size of the read area in sectors */
+  uint16_t first;    /* LBA of the first sector in the read area */
+  uint8_t  count;    /* number of valid sectors in the read area */
+} validate;
+
+/**
+ * validate_read - read a sector for validation
+ * @part  : partition number
+ * @track : track number
+ * @sector: sector number
+ *
+ * This function returns a pointer to the contents of the specified sector.
+ * Like sector_read it reads an aligned chunk of the track into the read
+ * area if the sector is not there yet. The pointer is valid until the
+ * next call. Returns NULL and sets the error message on failure.
+ */
+static uint8_t *validate_read(uint8_t part, uint8_t track, uint8_t sector) {
+  uint16_t lba;
+
+  if (track < 1 || track > get_param(part, LAST_TRACK) ||
+      sector >= sectors_per_track(part, track)) {
+    set_error_ts(ERROR_ILLEGAL_TS_LINK, track, sector);
+    return NULL;
+  }
+
+  lba = sector_lba(part, track, sector);
+
+  if (lba < validate.first || lba >= validate.first + validate.count) {
+    uint16_t count = sectors_per_track(part, track);
+    uint8_t  start = sector - sector % validate.size;
+    uint8_t  res;
+
+    count -= start;
+    if (count > validate.size)
+      count = validate.size;
+
+    validate.count = 0;
+    res = image_read(part, sector_offset(part, track, start),
+                     validate.data, count * 256);
+
+    if (res == 1) {
+      /* truncated image, try the sector on its own */
+      start = sector;
+      count = 1;
+      res = image_read(part, sector_offset(part, track, sector),
+                       validate.data, 256);
+    }
+
+    if (res) {
+      if (res == 1)
+        set_error_ts(ERROR_ILLEGAL_TS_LINK, track, sector);
+      return NULL;
+    }
+
+    validate.first = lba - (sector - start);
+    validate.count = count;
+  }
+
+  return validate.data + 256 * (lba - validate.first);
+}
+
+/**
+ * validate_mark - mark a sector as used in the sector map
+ * @part  : partition number
+ * @track : track number
+ * @sector: sector number
+ *
+ * This function marks the given sector as used. A sector that is used
+ * twice points to a loop or a cross-linked file, so it is reported
+ * as an error just like an invalid track/sector.
+ * Returns 0 if successful, 1 on error.
+ */
+static uint8_t validate_mark(uint8_t part, uint8_t track, uint8_t sector) {
+  uint16_t lba;
+
+  if (track < 1 || track > get_param(part, LAST_TRACK) ||
+      sector >= sectors_per_track(part, track)) {
+    set_error_ts(ERROR_ILLEGAL_TS_LINK, track, sector);
+    return 1;
+  }
+
+  lba = sector_lba(part, track, sector);
+  if (validate.map[lba / 8] & (1 << (lba & 7))) {
+    set_error_ts(ERROR_ILLEGAL_TS_LINK, track, sector);
+    return 1;
+  }
+
+  validate.map[lba / 8] |= 1 << (lba & 7);
+  return 0;
+}
+
+/**
+ * validate_chain - mark all sectors of a sector chain as used
+ * @part  : partition number
+ * @track : track of the first sector
+ * @sector: first sector
+ *
+ * Returns 0 if successful, 1 on error.
+ */
+static uint8_t validate_chain(uint8_t part, uint8_t track, uint8_t sector) {
+  uint8_t *data;
+
+  while (track != 0) {
+    if (validate_mark(part, track, sector))
+      return 1;
+
+    data = validate_read(part, track, sector);
+    if (data == NULL)
+      return 1;
+
+    track  = data[0];
+    sector = data[1];
+  }
+
+  return 0;
+}
+
+/**
+ * validate_entry - mark all sectors of a file as used
+ * @part : partition number
+ * @entry: pointer to the directory entry, starting at the file type
+ *
+ * This function marks the data sectors of a file and the side sectors
+ * of REL files, the sectors of 1581 partitions and the info block and
+ * record chains of GEOS files in the sector map.
+ * Returns 0 if successful, 1 on error.
+ */
+static uint8_t validate_entry(uint8_t part, uint8_t *entry) {
+  /* entry points to the file type, the link bytes are not included */
+  uint8_t  type   = entry[DIR_OFS_FILE_TYPE - 2] & TYPE_MASK;
+  uint8_t  track  = entry[DIR_OFS_TRACK - 2];
+  uint8_t  sector = entry[DIR_OFS_SECTOR - 2];
+  uint8_t  info_t = entry[DIR_OFS_SIDE_TRACK - 2];
+  uint8_t  info_s = entry[DIR_OFS_SIDE_SECTOR - 2];
+  uint8_t  geos   = entry[DIR_OFS_GEOS_TYPE - 2];
+  uint8_t  vlir   = entry[DIR_OFS_GEOS_STRUCT - 2];
+  uint16_t size   = entry[DIR_OFS_SIZE_LOW - 2] + 256 * entry[DIR_OFS_SIZE_HI - 2];
+  uint8_t *data;
+
+  if (type == TYPE_REL)
+    /* side sectors (and the super side sector) form a chain too */
+    return validate_chain(part, info_t, info_s) ||
+           validate_chain(part, track, sector);
+
+  if (type == TYPE_CBM &&
+      (partition[part].imagetype & D64_TYPE_MASK) == D64_TYPE_D81) {
+    /* 1581 partition: consecutive sectors */
+    while (size--) {
+      if (validate_mark(part, track, sector))
+        return 1;
+
+      if (++sector == sectors_per_track(part, track)) {
+        sector = 0;
+        track++;
+      }
+    }
+    return 0;
+  }
+
+  if (geos == 0)
+    return validate_chain(part, track, sector);
+
+  /* GEOS file */
+  if (info_t != 0 && validate_mark(part, info_t, info_s))
+    return 1;
+
+  if (vlir != 1)
+    return validate_chain(part, track, sector);
+
+  /* VLIR file, the index sector lists the chains of all records */
+  if (validate_mark(part, track, sector))
+    return 1;
+
+  for (uint8_t i = 2; i != 0; i += 2) {
+    data = validate_read(part, track, sector);
+    if (data == NULL)
+      return 1;
+
+    if (data[i] != 0 && validate_chain(part, data[i], data[i+1]))
+      return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * validate_dir - walk the directory tree of a disk image
+ * @part: partition number
+ * @fix : 0 to mark sectors, 1 to remove unclosed files
+ *
+ * This function walks all directory entries of the image, including
+ * DNP subdirectories. If @fix is 0, the directory sectors and all files
+ * are marked in the sector map and the number of unclosed files is
+ * returned. If @fix is 1, unclosed files are removed from the directory.
+ * Returns 255 on error.
+ */
+static uint8_t validate_dir(uint8_t part, uint8_t fix) {
+  uint8_t stack[VALIDATE_MAX_DEPTH][3];
+  uint8_t depth  = 0;
+  uint8_t splats = 0;
+  uint8_t track  = get_param(part, DIR_TRACK);
+  uint8_t sector = get_param(part, DIR_START_SECTOR);
+  uint8_t entry  = 0;
+  uint8_t *data;
+
+  if (partition[part].imagetype == D64_TYPE_DNP) {
+    /* skip the root directory header */
+    data = validate_read(part, track, sector);
+    if (data == NULL)
+      return 255;
+
+    track  = data[0];
+    sector = data[1];
+  }
+
+  while (1) {
+    if (entry == 0 && !fix && validate_mark(part, track, sector))
+      return 255;
+
+    data = validate_read(part, track, sector);
+    if (data == NULL)
+      return 255;
+
+    if (entry == 8) {
+      if (data[0] != 0) {
+        /* next directory sector */
+        track  = data[0];
+        sector = data[1];
+        entry  = 0;
+        continue;
+      }
+
+      /* end of directory */
+      if (depth == 0)
+        return splats;
+
+      depth--;
+      track  = stack[depth][0];
+      sector = stack[depth][1];
+      entry  = stack[depth][2];
+      continue;
+    }
+
+    data += 32 * entry++ + 2;
+    if (data[0] == 0)
+      continue;
+
+    if (!(data[0] & FLAG_SPLAT)) {
+      /* unclosed file, delete it like the 1541 does */
+      if (fix) {
+        data[0] = 0;
+        if (dxx_write(part, sector_offset(part, track, sector) +
+                      32 * (entry-1) + DIR_OFS_FILE_TYPE, data, 1, 0))
+          return 255;
+      } else if (splats < 254)
+        splats++;
+      continue;
+    }
+
+    if ((data[0] & TYPE_MASK) == TYPE_DIR &&
+        partition[part].imagetype == D64_TYPE_DNP) {
+      /* DNP subdirectory */
+      if (depth == VALIDATE_MAX_DEPTH) {
+        set_error(ERROR_DIR_ERROR);
+        return 255;
+      }
+
+      stack[depth][0] = track;
+      stack[depth][1] = sector;
+      stack[depth][2] = entry;
+      depth++;
+
+      track  = data[DIR_OFS_TRACK - 2];
+      sector = data[DIR_OFS_SECTOR - 2];
+
+      if (!fix && validate_mark(part, track, sector))
+        return 255;
+
+      data = validate_read(part, track, sector);
+      if (data == NULL)
+        return 255;
+
+      track  = data[DNP_DIRHEADER_DIR_TRACK];
+      sector = data[DNP_DIRHEADER_DIR_SECTOR];
+      entry  = 0;
+      continue;
+    }
+
+    if (!fix && validate_entry(part, data))
+      return 255;
+  }
+}
+
+/**
+ * validate_write_bam - write the sector map to the BAM
+ * @part: partition number
+ *
+ * This function replaces the bitfields and free sector counters of all
+ * tracks in the BAM with the contents of the sector map.
+ * Returns 0 if successful, 1 on error.
+ */
+static uint8_t validate_write_bam(uint8_t part) {
+  uint8_t  reversed = (partition[part].imagetype == D64_TYPE_DNP);
+  uint8_t *ptr;
+
+  for (uint16_t t = 1; t <= get_param(part, LAST_TRACK); t++) {
+    uint16_t count = sectors_per_track(part, t);
+    uint16_t lba   = sector_lba(part, t, 0);
+    uint16_t free  = 0;
+
+    if (move_bam_window(part, t, BAM_BITFIELD, &ptr))
+      return 1;
+
+    memset(ptr, 0, (count + 7) / 8);
+    for (uint16_t s = 0; s < count; s++, lba++) {
+      if (validate.map[lba / 8] & (1 << (lba & 7)))
+        continue;
+
+      ptr[s >> 3] |= reversed ? 0x80 >> (s & 7) : 1 << (s & 7);
+      free++;
+    }
+    bam_buffer->mustflush = 1;
+
+    if (reversed)
+      /* DNP has no counter in its BAM */
+      continue;
+
+    if (move_bam_window(part, t, BAM_FREECOUNT, &ptr))
+      return 1;
+
+    *ptr = free;
+    bam_buffer->mustflush = 1;
+  }
+
+  return 0;
+}
+
+/**
+ * d64_validate - rebuild the BAM of a disk image
+ * @part: partition number
+ *
+ * This function rebuilds the BAM of the image mounted on @part from the
+ * sectors that are used by the directory and the files in it. Unclosed
+ * files are deleted. The sector map is built in the track cache memory,
+ * so the BAM is only written once at the end and stays unchanged if an
+ * error is found in the directory or a file.
+ */
+void d64_validate(uint8_t part) {
+  uint8_t  last = get_param(part, LAST_TRACK);
+  uint8_t  mapsize, splats;
+
+  if (!(image_handle(part)->flag & FA_WRITE)) {
+    set_error(ERROR_WRITE_PROTECT);
+    return;
+  }
+
+  /* one bit per sector, rounded up to whole sectors */
+  mapsize = (sector_lba(part, last, 0) + sectors_per_track(part, last) + 2047UL) / 2048;
+  if (mapsize >= TRACKCACHE_SECTORS) {
+    /* the track cache is too small for this image */
+    set_error(ERROR_NO_CHANNEL);
+    return;
+  }
+
+  free_multiple_buffers(FMB_USER_CLEAN);
+  d64_prefetch_cancel();
+  if (d64_bam_commit())
+    return;
+
+  trackcache_invalidate();
+  validate.map   = trackcache_data;
+  validate.data  = trackcache_data + 256 * mapsize;
+  validate.size  = TRACKCACHE_SECTORS - mapsize;
+  validate.count = 0;
+  memset(validate.map, 0, 256 * mapsize);
+
+  /* sectors that are not part of a chain */
+  switch (partition[part].imagetype & D64_TYPE_MASK) {
+  case D64_TYPE_D71:
+    for (uint8_t s = 0; s < sectors_per_track(part, D71_BAM2_TRACK); s++)
+      validate_mark(part, D71_BAM2_TRACK, s);
+    /* fall through */
+
+  case D64_TYPE_D41:
+    validate_mark(part, D41_BAM_TRACK, D41_BAM_SECTOR);
+    break;
+
+  case D64_TYPE_D81:
+    for (uint8_t s = 0; s <= D81_BAM_SECTOR2; s++)
+      validate_mark(part, D81_BAM_TRACK, s);
+    break;
+
+  case D64_TYPE_DNP:
+    /* reserved sector, root directory header and BAM */
+    for (uint8_t s = 0; s < DNP_BAM_SECTOR + 32; s++)
+      validate_mark(part, DNP_BAM_TRACK, s);
+    break;
+  }
+
+  splats = validate_dir(part, 0);
+  if (splats == 255)
+    goto done;
+
+  if (splats != 0 && validate_dir(part, 1) == 255)
+    goto done;
+
+  validate_write_bam(part);
+  d64_bam_commit();
+
+ done:
+  /* the directory may have changed, the track cache was overwritten */
+  trackcache_invalidate();
+  dircache_invalidate();
+  dirindex_invalidate();
+  seekindex_invalidate();
+}
+#endif
+
 /* ------------------------------------------------------------------------- */
 /*  ops struct                                                               */
 /* ------------------------------------------------------------------------- */
@@ -33,6 +33,11 @@
 #define DIR_OFS_TRACK           3
 #define DIR_OFS_SECTOR          4
 #define DIR_OFS_FILE_NAME       5
+#define DIR_OFS_SIDE_TRACK      0x15
+#define DIR_OFS_SIDE_SECTOR     0x16
+#define DIR_OFS_RECORD_LEN      0x17
+#define DIR_OFS_GEOS_STRUCT     0x17
+#define DIR_OFS_GEOS_TYPE       0x18
 #define DIR_OFS_YEAR            0x19
 #define DIR_OFS_MONTH           0x1a
 #define DIR_OFS_DAY             0x1b
@@ -61,4 +66,47 @@ uint8_t d64_bam_commit(void);
 void d64_raw_directory(path_t *path, buffer_t *buf);
 void d64_invalidate(void);
 
+#ifdef CONFIG_MOUNT_CACHE
+/* forget the cached state of unmounted images */
+void d64_mountcache_invalidate(void);
+#else
+#  define d64_mountcache_invalidate() do {} while (0)
+#endif
+
+#ifdef CONFIG_IMAGE_SLOTS
+/* check if files are open in the image on a partition */
+uint8_t d64_image_busy(uint8_t part);
+#endif
+
+#ifdef CONFIG_VALIDATE
+/* rebuild the BAM from the directory */
+void d64_validate(uint8_t part);
+#endif
+
+#ifdef CONFIG_READ_BENCHMARK
+/* average number of CPU cycles per sector read */
+uint16_t d64_read_benchmark(uint8_t part);
+#endif
+
+#ifdef CONFIG_CHAIN_PREFETCH
+/* read the pending prefetch sector, called while the bus is idle */
+void d64_prefetch_service(void);
+
+/* drop the prefetched sector */
+void d64_prefetch_cancel(void);
+#else
+#  define d64_prefetch_service() do {} while (0)
+#  define d64_prefetch_cancel()  do {} while (0)
+#endif
+
+#if defined(CONFIG_TRACK_CACHE) && defined(CONFIG_RAM_POOL)
+/* set the memory used by the track cache */
+void d64_trackcache_setup(uint8_t *data, uint8_t sectors);
+#endif
+
+#ifdef CONFIG_DIR_INDEX
+/* skip to the next directory entry that may match name */
+void d64_find_name(dh_t *dh, uint8_t *name);
+#endif
+
 #endif
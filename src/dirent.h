@@ -164,7 +164,7 @@ typedef struct {
   uint16_t  blocksize;
   uint8_t   remainder;
   date_t    date;
-  opstype_t opstype;
+  uint8_t   opstype;  /* opstype_t */
   union {
     struct {
       uint32_t cluster;
@@ -186,9 +186,21 @@ typedef struct {
  * @track : current track
  * @sector: current sector
  * @blocks: number of sectors allocated before the current
+ * @first_track : track of the first sector of the file
+ * @first_sector: sector of the first sector of the file
+ * @side_track : REL only: track of the (super) side sector
+ * @side_sector: REL only: sector of the (super) side sector
+ * @ss_index   : REL only: index of the side sector in ss_track/ss_sector
+ * @ss_track   : REL only: track of the most recently used side sector
+ * @ss_sector  : REL only: sector of the most recently used side sector
+ * @relsize    : REL only: number of record data bytes in the file
  *
  * This structure holds the information required to write to a file
  * in a D64 image and update its directory entry upon close.
+ * For files opened for reading, track/sector point to the sector in
+ * the buffer and blocks is its number within the file.
+ * For REL files, track/sector point to the last data block and
+ * blocks is the total number of blocks of the file.
  */
 typedef struct d64fh {
   struct d64dh dh;
@@ -196,6 +208,14 @@ typedef struct d64fh {
   uint8_t track;
   uint8_t sector;
   uint16_t blocks;
+  uint8_t first_track;
+  uint8_t first_sector;
+  uint8_t side_track;
+  uint8_t side_sector;
+  uint16_t ss_index;
+  uint8_t ss_track;
+  uint8_t ss_sector;
+  uint32_t relsize;
 } d64fh_t;
 
 /**
@@ -234,9 +254,14 @@ typedef enum { DIR_TRACK = 0, DIR_START_SECTOR,
  * @file_interleave : interleave factor for file sectors
  * @dir_interleave  : interleave factor for directory sectors
  * @format_function : image-specific format function
+ * @track_lba       : LBA of the first sector of each track (in flash),
+ *                    NULL if all tracks have the same number of sectors
+ * @sectors         : number of sectors per track if track_lba is NULL
+ * @bam_locate      : image-specific BAM position function
  *
  * This structure holds those parameters that differ between various Dxx
- * disk images and which could be abstracted out easily.
+ * disk images and which could be abstracted out easily. It is selected
+ * once when the image is mounted.
  */
 struct param_s {
   uint8_t dir_track;
@@ -248,6 +273,9 @@ struct param_s {
   uint8_t dir_interleave;
   // Insert new fields here, otherwise get_param will fail!
   void    (*format_function)(uint8_t part, struct buffer_s *buf, uint8_t *name, uint8_t *idbuf);
+  const uint16_t *track_lba;
+  uint16_t sectors;
+  uint8_t (*bam_locate)(uint8_t track, uint8_t type, uint8_t *ts);
 };
 
 /**
@@ -255,7 +283,10 @@ struct param_s {
  * @fatfs      : FatFs per-drive/partition structure
  * @current_dir: current directory on FAT as seen by sd2iec
  * @fop        : pointer to the fileops structure for this partition
- * @imagehandle: file handle of a mounted image file on this partition
+ * @imagehandle: file handle of a mounted image file on this partition,
+ *               taken from a pool if CONFIG_IMAGE_HANDLES is set
+ * @imagelba   : first card sector of a mounted image file that is stored
+ *               in consecutive clusters, 0 if it is fragmented
  * @imagetype  : disk image type mounted on this partition
  * @d64data    : extended information about a mounted Dxx image
  *
@@ -265,7 +296,14 @@ typedef struct partition_s {
   FATFS                  fatfs;
   dir_t                  current_dir;
   const struct fileops_s *fop;
+#ifdef CONFIG_IMAGE_HANDLES
+  FIL                    *imagehandle;
+#else
   FIL                    imagehandle;
+#endif
+#ifdef CONFIG_IMAGE_DIRECT_LBA
+  DWORD                  imagelba;
+#endif
   uint8_t                imagetype;
   struct param_s         d64data;
 } partition_t;
@@ -455,6 +455,12 @@ static void parse_chdir(void) {
   if (parse_path(command_buffer+2, &path, &name, 1))
     return;
 
+  if (is_image_slot(path.part)) {
+    /* Images in a path are not mounted on the partition */
+    set_error(ERROR_FILE_NOT_FOUND_39);
+    return;
+  }
+
   if (ustrlen(name) != 0) {
     /* Path component after the : */
     if (name[0] == '_') {
@@ -621,7 +627,7 @@ static void parse_block(void) {
       uint8_t count = params[2];
 
       /* Walk the chain, wrap whenever necessary */
-      buf->secondary = BUFFER_SEC_CHAIN - params[0];
+      set_buffer_secondary(buf, BUFFER_SEC_CHAIN - params[0]);
       buf = buf->pvt.buffer.first;
       while (count--) {
         if (buf->pvt.buffer.next != NULL)
@@ -629,7 +635,7 @@ static void parse_block(void) {
         else
           buf = buf->pvt.buffer.first;
       }
-      buf->secondary = params[0];
+      set_buffer_secondary(buf, params[0]);
       buf->mustflush = 0;
     }
     buf->position = params[1];
@@ -842,9 +848,9 @@ static void parse_direct(void) {
 
   if (buf->pvt.buffer.size > 1) {
     uint8_t oldsec = buf->secondary;
-    buf->secondary = BUFFER_SEC_CHAIN - oldsec;
+    set_buffer_secondary(buf, BUFFER_SEC_CHAIN - oldsec);
     buf = buf->pvt.buffer.first;
-    buf->secondary = oldsec;
+    set_buffer_secondary(buf, oldsec);
   }
 
   buf->position = 0;
@@ -1234,7 +1240,7 @@ static void handle_memwrite(void) {
       return;
 
     stick_buffer(buf);
-    buf->secondary = BUFFER_SYS_GEOSKEY;
+    set_buffer_secondary(buf, BUFFER_SYS_GEOSKEY);
     if (datacrc == 0xb979) {
       /* GEOS 64 1.3/2.0 */
       buf->position = 32-10;
@@ -1448,19 +1454,24 @@ static void parse_scratch(void) {
 
   set_dirty_led(1);
   count = 0;
+#ifdef CONFIG_SCRATCH_BATCH
+  /* delete the matches in a single directory pass, commit once at the end */
+  globalflags |= SCRATCH_BATCH;
+#endif
+
   /* Loop over all file names */
   while (filename != NULL) {
     parse_path(filename, &path, &name, 0);
 
     if (opendir(&matchdh, &path))
-      return;
+      goto done;
 
     while (1) {
       res = next_match(&matchdh, name, NULL, NULL, FLAG_HIDDEN, &dent);
       if (res < 0)
         break;
       if (res > 0)
-        return;
+        goto done;
 
       /* Skip directories */
       if ((dent.typeflags & TYPE_MASK) == TYPE_DIR)
@@ -1469,13 +1480,21 @@ static void parse_scratch(void) {
       if (cnt != 255)
         count += cnt;
       else
-        return;
+        goto done;
     }
 
     filename = ustr1tok(NULL,',',&tmp);
   }
 
   set_error_ts(ERROR_SCRATCHED,count,0);
+
+  done:
+#ifdef CONFIG_SCRATCH_BATCH
+  globalflags &= (uint8_t)~SCRATCH_BATCH;
+  fat_delete_commit();
+  d64_bam_commit();
+#endif
+  return;
 }
 
 
@@ -1743,6 +1762,30 @@ static void parse_user(void) {
 }
 
 
+#ifdef CONFIG_VALIDATE
+/* -------------- */
+/*  V - Validate  */
+/* -------------- */
+static void parse_validate(void) {
+  uint8_t *str;
+  uint8_t part;
+
+  clean_cmdbuffer();
+
+  str  = command_buffer+1;
+  part = parse_partition(&str);
+  if (part >= max_part) {
+    set_error(ERROR_DRIVE_NOT_READY);
+    return;
+  }
+
+  /* Nothing to do for FAT and M2I */
+  if (partition[part].fop == &d64ops)
+    d64_validate(part);
+}
+#endif
+
+
 /* ------------ */
 /*  X commands  */
 /* ------------ */
@@ -1767,6 +1810,19 @@ static void parse_xcommand(void) {
     }
     break;
 
+  case 'A':
+    /* Sector allocation for files in disk images */
+    num = parse_bool();
+    if (num != 255) {
+      if (num)
+        globalflags |= CARD_INTERLEAVE;
+      else
+        globalflags &= (uint8_t)~CARD_INTERLEAVE;
+
+      set_error_ts(ERROR_STATUS,device_address,0);
+    }
+    break;
+
   case 'E':
     /* Change file extension mode */
     str = command_buffer+2;
@@ -1896,6 +1952,57 @@ static void parse_xcommand(void) {
     }
     break;
 
+#ifdef CONFIG_DEFRAG
+  case 'F':
+    /* Fragment count of a file or the mounted image, ! defragments it */
+    {
+      cbmdirent_t dent;
+      uint8_t defrag = 0;
+
+      str = command_buffer + 2;
+      if (*str == '!') {
+        defrag = 1;
+        str++;
+      }
+
+      if (ustrchr(str, ':')) {
+        if (parse_path(str, &path, &str, 0))
+          return;
+
+        if (first_match(&path, str, FLAG_HIDDEN, &dent))
+          return;
+
+        fat_fragments(&path, &dent, defrag);
+      } else {
+        path.part = parse_partition(&str);
+        if (path.part >= max_part) {
+          set_error_ts(ERROR_PARTITION_ILLEGAL, path.part+1, 0);
+          return;
+        }
+
+        fat_fragments(&path, NULL, defrag);
+      }
+    }
+    break;
+#endif
+
+#ifdef CONFIG_RAM_POOL
+  case 'M':
+    /* Show how the RAM pool is used */
+    set_error_ts(ERROR_STATUS,device_address,2);
+    break;
+#endif
+
+#ifdef CONFIG_READ_BENCHMARK
+  case 'T':
+    /* Average CPU cycles per sector read in the current disk image */
+    {
+      uint16_t cycles = d64_read_benchmark(current_part);
+      set_error_ts(ERROR_OK, cycles >> 8, cycles & 0xff);
+    }
+    break;
+#endif
+
 #ifdef CONFIG_STACK_TRACKING
   case '?':
     /* Output the largest stack size seen */
@@ -2039,6 +2146,13 @@ void parse_doscommand(void) {
     parse_user();
     break;
 
+#ifdef CONFIG_VALIDATE
+  case 'V':
+    /* Validate */
+    parse_validate();
+    break;
+#endif
+
   case 'X':
     parse_xcommand();
     break;
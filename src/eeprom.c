@@ -116,8 +116,8 @@ void read_configuration(void) {
 
   /* Read data from EEPROM */
   tmp = eeprom_read_byte(&storedconfig.global_flags);
-  globalflags &= (uint8_t)~(POSTMATCH |
-                            EXTENSION_HIDING | FAT32_FREEBLOCKS);
+  globalflags &= (uint8_t)~(POSTMATCH | EXTENSION_HIDING |
+                            FAT32_FREEBLOCKS | CARD_INTERLEAVE);
   globalflags |= tmp;
 
   if (eeprom_read_byte(&storedconfig.hardaddress) == device_hw_address())
@@ -162,8 +162,8 @@ void write_configuration(void) {
   /* Write configuration to EEPROM */
   eeprom_write_word(&storedconfig.structsize, sizeof(storedconfig));
   eeprom_write_byte(&storedconfig.global_flags,
-                    globalflags & (POSTMATCH |
-                                   EXTENSION_HIDING | FAT32_FREEBLOCKS));
+                    globalflags & (POSTMATCH | EXTENSION_HIDING |
+                                   FAT32_FREEBLOCKS | CARD_INTERLEAVE));
   eeprom_write_byte(&storedconfig.address, device_address);
   eeprom_write_byte(&storedconfig.hardaddress, device_hw_address());
   eeprom_write_byte(&storedconfig.fileexts, file_extension_mode);
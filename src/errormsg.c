@@ -204,6 +204,8 @@ void set_error_ts(uint8_t errornum, uint8_t track, uint8_t sector) {
 
       msg = appendbool(msg, 'B', globalflags & FAT32_FREEBLOCKS);
 
+      msg = appendbool(msg, 'A', globalflags & CARD_INTERLEAVE);
+
       *msg++ = 'I';
       msg = appendnumber(msg, image_as_dir);
 
@@ -225,6 +227,24 @@ void set_error_ts(uint8_t errornum, uint8_t track, uint8_t sector) {
         i++;
       }
       break;
+
+#ifdef CONFIG_RAM_POOL
+    case 2: // RAM pool split
+      *msg++ = 'M';
+      *msg++ = ':';
+      *msg++ = 'B';
+      msg = appendnumber(msg, pool_split.buffers);
+      *msg++ = ':';
+      *msg++ = 'S';
+      msg = appendnumber(msg, pool_split.spares);
+      *msg++ = ':';
+      *msg++ = 'C';
+      msg = appendnumber(msg, pool_split.cache);
+      *msg++ = ':';
+      *msg++ = 'F';
+      msg = appendnumber(msg, pool_split.unused);
+      break;
+#endif
     }
 
   } else if (errornum == ERROR_LONGVERSION || errornum == ERROR_DOSVERSION) {
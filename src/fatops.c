@@ -58,10 +58,138 @@ typedef enum { EXT_UNKNOWN, EXT_IS_X00, EXT_IS_TYPE } exttype_t;
 
 uint8_t file_extension_mode;
 
+#ifdef CONFIG_IMAGE_PAIR_BUFFER
+/* card sector that was read last from an image file */
+static struct {
+  uint8_t part;      /* partition of the buffered data, 255 if invalid */
+  UINT    length;    /* number of valid bytes */
+  DWORD   offset;    /* image offset of the card sector */
+  uint8_t data[512];
+} imagepair;
+
+#  define imagepair_invalidate() imagepair.part = 255
+#else
+#  define imagepair_invalidate() do {} while (0)
+#endif
+
+#if defined(CONFIG_IMAGE_DIRECT_LBA) && !defined(CONFIG_IMAGE_PAIR_BUFFER)
+#  error "CONFIG_IMAGE_DIRECT_LBA requires CONFIG_IMAGE_PAIR_BUFFER!"
+#endif
+
+#ifdef CONFIG_IMAGE_SLOTS
+#  if CONFIG_IMAGE_SLOTS < 2 || CONFIG_IMAGE_SLOTS > 8
+#    error "CONFIG_IMAGE_SLOTS must be between 2 and 8!"
+#  endif
+
+/* image slots, most recently used first */
+static uint8_t slotorder[CONFIG_IMAGE_SLOTS];
+
+/* partition of the image file mounted in each slot */
+static uint8_t slotowner[CONFIG_IMAGE_SLOTS];
+
+static uint8_t image_slot_release(uint8_t part, DWORD cluster);
+#else
+#  define image_slot_release(part,cluster) 0
+#endif
+
+#ifdef CONFIG_IMAGE_HANDLES
+#  if CONFIG_IMAGE_HANDLES < 1 || CONFIG_IMAGE_HANDLES > 8
+#    error "CONFIG_IMAGE_HANDLES must be between 1 and 8!"
+#  endif
+
+/* file handles for mounted images and short accesses to files on FAT */
+static FIL imagehandles[CONFIG_IMAGE_HANDLES];
+
+/* bitmap of the handles in use */
+static uint8_t handlesused;
+
+static FIL *handle_alloc(void);
+static void handle_free(FIL *fh);
+
+#  define image_handle_get(part) \
+  ((partition[part].imagehandle = handle_alloc()) == NULL)
+#  define image_handle_put(part) do { \
+    handle_free(partition[part].imagehandle); \
+    partition[part].imagehandle = NULL;       \
+  } while (0)
+#  define scratch_get(part) handle_alloc()
+#  define scratch_put(fh)   handle_free(fh)
+#else
+#  define image_handle_get(part) 0
+#  define image_handle_put(part) do {} while (0)
+#  define scratch_get(part) image_handle(part)
+#  define scratch_put(fh)   do {} while (0)
+#endif
+
+#ifdef CONFIG_SCRATCH_BATCH
+/* directory position before the entry returned by the last fat_readdir */
+static struct {
+  uint8_t part;      /* partition of the position, 255 if invalid */
+  DIR     dir;
+} lastentry;
+
+/* partition with deletes that are not synced yet, 255 if none */
+static uint8_t unsynced_part = 255;
+#endif
+
 /* ------------------------------------------------------------------------- */
 /*  Utility functions                                                        */
 /* ------------------------------------------------------------------------- */
 
+#ifdef CONFIG_IMAGE_HANDLES
+/**
+ * handle_alloc - get a file handle for an image or a short access
+ *
+ * This function returns an unused file handle from the pool. If all of
+ * them are in use, the handle is placed in the data area of a system
+ * buffer instead, so the pool size only limits how many images can be
+ * mounted without tying up a buffer. Returns NULL if no buffer is free
+ * either, the error is set in that case.
+ */
+static FIL *handle_alloc(void) {
+  buffer_t *buf;
+  uint8_t i;
+
+  for (i = 0; i < CONFIG_IMAGE_HANDLES; i++)
+    if (!(handlesused & (1 << i))) {
+      handlesused |= 1 << i;
+      return &imagehandles[i];
+    }
+
+  buf = alloc_system_buffer();
+  if (buf == NULL)
+    return NULL;
+
+  buf->secondary = BUFFER_SYS_HANDLE;
+  buf->sticky    = 1;
+  return (FIL *)buf->data;
+}
+
+/**
+ * handle_free - release a file handle
+ * @fh: file handle returned by handle_alloc, may be NULL
+ *
+ * This function returns @fh to the pool or frees the buffer it is
+ * stored in. The file must be closed already.
+ */
+static void handle_free(FIL *fh) {
+  uint8_t i;
+
+  for (i = 0; i < CONFIG_IMAGE_HANDLES; i++)
+    if (fh == &imagehandles[i]) {
+      handlesused &= (uint8_t)~(1 << i);
+      return;
+    }
+
+  for (i = 0; i < CONFIG_BUFFER_COUNT; i++)
+    if (buffers[i].allocated && buffers[i].secondary == BUFFER_SYS_HANDLE &&
+        buffers[i].data == (uint8_t *)fh) {
+      free_buffer(&buffers[i]);
+      return;
+    }
+}
+#endif
+
 /**
  * parse_error - translates a ff FRESULT into a commodore error message
  * @res     : FRESULT to be translated
@@ -294,26 +422,22 @@ static uint8_t* build_name(uint8_t *name, uint8_t type) {
 /* ------------------------------------------------------------------------- */
 
 /**
- * fat_file_read - read the next data block into the buffer
+ * read_data - read the next data block into the buffer
  * @buf: buffer to be worked on
  *
  * This function reads the next block of data from the associated file into
- * the given buffer. Used as a refill-callback when reading files
+ * the data area of the given buffer. Returns the result of f_read, the
+ * caller handles errors.
  */
-static uint8_t fat_file_read(buffer_t *buf) {
+static FRESULT read_data(buffer_t *buf) {
   FRESULT res;
   UINT bytesread;
 
-  uart_putc('#');
-
   buf->fptr = buf->pvt.fat.fh.fptr - buf->pvt.fat.headersize;
 
   res = f_read(&buf->pvt.fat.fh, buf->data+2, (buf->recordlen ? buf->recordlen : 254), &bytesread);
-  if (res != FR_OK) {
-    parse_error(res,1);
-    free_buffer(buf);
-    return 1;
-  }
+  if (res != FR_OK)
+    return res;
 
   /* The bus protocol can't handle 0-byte-files */
   if (bytesread == 0) {
@@ -334,17 +458,77 @@ static uint8_t fat_file_read(buffer_t *buf) {
   else
     buf->sendeoi = 0;
 
+  return FR_OK;
+}
+
+/**
+ * fat_file_read - read the next data block into the buffer
+ * @buf: buffer to be worked on
+ *
+ * This function reads the next block of data from the associated file into
+ * the given buffer. Used as a refill-callback when reading files
+ */
+static uint8_t fat_file_read(buffer_t *buf) {
+  FRESULT res;
+
+  uart_putc('#');
+
+#ifdef CONFIG_SPARE_BUFFERS
+  if (buf->sparestate == SPARE_FULL) {
+    /* The block was already read while the bus was idle */
+    swap_spare(buf);
+    buf->sparestate = SPARE_EMPTY;
+    buf->position   = 2;
+    buf->lastused   = buf->sparelast;
+    buf->sendeoi    = buf->spareeoi;
+    buf->fptr       = buf->sparefptr;
+    return 0;
+  }
+#endif
+
+  res = read_data(buf);
+  if (res != FR_OK) {
+    parse_error(res,1);
+    free_buffer(buf);
+    return 1;
+  }
+
   return 0;
 }
 
+/* write_block result for a short write */
+#define WRITE_DISK_FULL 0xff
+
 /**
- * write_data - write the current buffer data
+ * write_failed - report a failed write and close the file
+ * @buf: buffer to be worked on
+ * @res: result of write_block
+ *
+ * This function sets the error for a failed write, closes the file and
+ * frees the buffer. It must only be called by the owner of the buffer.
+ */
+static void write_failed(buffer_t *buf, uint8_t res) {
+  if (res == WRITE_DISK_FULL) {
+    uart_putc('l');
+    set_error(ERROR_DISK_FULL);
+  } else {
+    uart_putc('r');
+    parse_error(res,1);
+  }
+  f_close(&buf->pvt.fat.fh);
+  free_buffer(buf);
+}
+
+/**
+ * write_block - write the current buffer data
  * @buf: buffer to be worked on
  *
  * This function writes the current contents of the given buffer into its
- * associated file.
+ * associated file. Returns FR_OK if successful, the FRESULT of a failed
+ * write or WRITE_DISK_FULL if the medium is full. The buffer stays
+ * allocated in all cases.
  */
-static uint8_t write_data(buffer_t *buf) {
+static uint8_t write_block(buffer_t *buf) {
   FRESULT res;
   UINT byteswritten;
 
@@ -360,21 +544,11 @@ static uint8_t write_data(buffer_t *buf) {
     buf->lastused = buf->recordlen + 1;
 
   res = f_write(&buf->pvt.fat.fh, buf->data+2, buf->lastused-1, &byteswritten);
-  if (res != FR_OK) {
-    uart_putc('r');
-    parse_error(res,1);
-    f_close(&buf->pvt.fat.fh);
-    free_buffer(buf);
-    return 1;
-  }
+  if (res != FR_OK)
+    return res;
 
-  if (byteswritten != buf->lastused-1U) {
-    uart_putc('l');
-    set_error(ERROR_DISK_FULL);
-    f_close(&buf->pvt.fat.fh);
-    free_buffer(buf);
-    return 1;
-  }
+  if (byteswritten != buf->lastused-1U)
+    return WRITE_DISK_FULL;
 
   mark_buffer_clean(buf);
   buf->mustflush = 0;
@@ -382,8 +556,146 @@ static uint8_t write_data(buffer_t *buf) {
   buf->lastused  = 2;
   buf->fptr      = buf->pvt.fat.fh.fptr - buf->pvt.fat.headersize;
 
+  return FR_OK;
+}
+
+/**
+ * write_data - write the current buffer data
+ * @buf: buffer to be worked on
+ *
+ * This function writes the current contents of the given buffer into its
+ * associated file. Returns 1 if an error occured, the buffer is freed in
+ * that case.
+ */
+static uint8_t write_data(buffer_t *buf) {
+  uint8_t res = write_block(buf);
+
+  if (res != FR_OK) {
+    write_failed(buf, res);
+    return 1;
+  }
+
+  return 0;
+}
+
+#ifdef CONFIG_SPARE_BUFFERS
+/**
+ * write_pending - write the block deferred into the second data area
+ * @buf: buffer to be worked on
+ *
+ * This function writes the full block that fat_file_write left in the
+ * second data area of the buffer, if there is one. The data that was
+ * written to the buffer since then is kept. Returns FR_OK if successful
+ * or the result of write_block otherwise, the block is dropped and the
+ * buffer stays allocated in that case.
+ */
+static uint8_t write_pending(buffer_t *buf) {
+  uint8_t position  = buf->position;
+  uint8_t lastused  = buf->lastused;
+  uint8_t mustflush = buf->mustflush;
+  uint8_t res;
+
+  swap_spare(buf);
+  buf->sparestate = SPARE_EMPTY;
+  buf->mustflush  = 1;
+  buf->lastused   = 255;
+  res = write_block(buf);
+
+  swap_spare(buf);
+  buf->position  = position;
+  buf->mustflush = mustflush;
+  buf->lastused  = lastused;
+
+  /* A failed block keeps the buffer dirty until the error is reported */
+  if (res != FR_OK || position > 2 || mustflush)
+    mark_buffer_dirty(buf);
+
+  return res;
+}
+
+/**
+ * write_spare - write the block deferred into the second data area
+ * @buf: buffer to be worked on
+ *
+ * This function writes the block that is waiting in the second data area
+ * of the buffer or reports the error of a write that failed while the
+ * buffer was serviced. Returns 1 if an error occured, the file is closed
+ * and the buffer freed in that case.
+ */
+static uint8_t write_spare(buffer_t *buf) {
+  uint8_t res;
+
+  if (buf->sparestate == SPARE_FAILED) {
+    buf->sparestate = SPARE_EMPTY;
+    res = buf->sparelast;
+  } else if (buf->sparestate == SPARE_PENDING)
+    res = write_pending(buf);
+  else
+    return 0;
+
+  if (res != FR_OK) {
+    write_failed(buf, res);
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * fat_file_service - service-callback for the second data area
+ * @buf: buffer to be worked on
+ *
+ * This function reads the next block of a file opened for reading into
+ * the second data area or writes the block that is waiting there for a
+ * file opened for writing. Errors while reading ahead are not reported,
+ * the block is read again by the refill-callback which reports them.
+ * A failed write is kept in the buffer and reported by the next call of
+ * write_spare, so the buffer is never freed here while its owner may
+ * still use it. Used as a service-callback between bus transfers.
+ */
+static uint8_t fat_file_service(buffer_t *buf) {
+  uint8_t position, lastused, sendeoi;
+  uint32_t fptr;
+
+  if (buf->write) {
+    if (buf->sparestate == SPARE_PENDING) {
+      uint8_t res = write_pending(buf);
+
+      if (res != FR_OK) {
+        buf->sparestate = SPARE_FAILED;
+        buf->sparelast  = res;
+      }
+    }
+    return 0;
+  }
+
+  if (buf->sparestate != SPARE_EMPTY || buf->sendeoi || buf->recordlen)
+    return 0;
+
+  position = buf->position;
+  lastused = buf->lastused;
+  sendeoi  = buf->sendeoi;
+  fptr     = buf->fptr;
+
+  swap_spare(buf);
+  if (read_data(buf) == FR_OK) {
+    buf->sparestate = SPARE_FULL;
+    buf->sparelast  = buf->lastused;
+    buf->spareeoi   = buf->sendeoi;
+    buf->sparefptr  = buf->fptr;
+  }
+  swap_spare(buf);
+
+  buf->position = position;
+  buf->lastused = lastused;
+  buf->sendeoi  = sendeoi;
+  buf->fptr     = fptr;
+
   return 0;
 }
+#else
+#  define write_spare(buf) 0
+#endif
 
 /**
  * fat_file_write - refill-callback for files opened for writing
@@ -396,8 +708,24 @@ static uint8_t fat_file_write(buffer_t *buf) {
   uint32_t fptr;
   uint32_t i = 0;
 
+  if (write_spare(buf))
+    return 1;
+
   fptr = buf->pvt.fat.fh.fsize - buf->pvt.fat.headersize;
 
+#ifdef CONFIG_SPARE_BUFFERS
+  if (buf->spare != NULL && buf->mustflush && buf->fptr == fptr) {
+    /* Keep the full block and write it during the next block */
+    swap_spare(buf);
+    buf->sparestate = SPARE_PENDING;
+    buf->mustflush  = 0;
+    buf->position   = 2;
+    buf->lastused   = 2;
+    buf->fptr      += 254;
+    return 0;
+  }
+#endif
+
   // on a REL file, the fptr will be be at the end of the record we just read.  Reposition.
   if (buf->fptr != fptr) {
     res = f_lseek(&buf->pvt.fat.fh, buf->pvt.fat.headersize + buf->fptr);
@@ -469,6 +797,13 @@ uint8_t fat_file_seek(buffer_t *buf, uint32_t position, uint8_t index) {
     if (fat_file_write(buf))
       return 1;
 
+#ifdef CONFIG_SPARE_BUFFERS
+  /* Write a deferred block or drop the block that was read ahead */
+  if (write_spare(buf))
+    return 1;
+  buf->sparestate = SPARE_EMPTY;
+#endif
+
   if (buf->pvt.fat.fh.fsize >= pos) {
     FRESULT res = f_lseek(&buf->pvt.fat.fh, pos);
     if (res != FR_OK) {
@@ -521,6 +856,10 @@ static uint8_t fat_file_close(buffer_t *buf) {
     /* Write the remaining data using the callback */
     if (buf->refill(buf))
       return 1;
+
+    /* The callback may have deferred a full block */
+    if (write_spare(buf))
+      return 1;
   }
 
   res = f_close(&buf->pvt.fat.fh);
@@ -575,6 +914,11 @@ void fat_open_read(path_t *path, cbmdirent_t *dent, buffer_t *buf) {
   buf->refill    = fat_file_read;
   buf->seek      = fat_file_seek;
 
+#ifdef CONFIG_SPARE_BUFFERS
+  /* Read ahead during transfers if a second data area is free */
+  alloc_spare(buf, fat_file_service);
+#endif
+
   stick_buffer(buf);
 
   /* Call the refill once for the first block of data */
@@ -667,6 +1011,9 @@ void fat_open_write(path_t *path, cbmdirent_t *dent, uint8_t type, buffer_t *buf
   FRESULT res;
 
   if (append) {
+    d64_mountcache_invalidate();
+    if (image_slot_release(path->part, dent->pvt.fat.cluster))
+      return;
     partition[path->part].fatfs.curr_dir = path->dir.fat;
     res = f_open(&partition[path->part].fatfs, &buf->pvt.fat.fh, dent->pvt.fat.realname, FA_WRITE | FA_OPEN_EXISTING);
     if (dent->opstype == OPSTYPE_FAT_X00)
@@ -690,6 +1037,11 @@ void fat_open_write(path_t *path, cbmdirent_t *dent, uint8_t type, buffer_t *buf
   buf->refill    = fat_file_write;
   buf->seek      = fat_file_seek;
 
+#ifdef CONFIG_SPARE_BUFFERS
+  /* Write full blocks during transfers if a second area is free */
+  alloc_spare(buf, fat_file_service);
+#endif
+
   /* If no data is written the file should end up with a single 0x0d byte */
   buf->data[2] = 13;
 
@@ -717,6 +1069,9 @@ void fat_open_rel(path_t *path, cbmdirent_t *dent, buffer_t *buf, uint8_t length
     bytesread = 1;
     entrybuf[0] = length;
   } else {
+    d64_mountcache_invalidate();
+    if (image_slot_release(path->part, dent->pvt.fat.cluster))
+      return;
     partition[path->part].fatfs.curr_dir = path->dir.fat;
     res = f_open(&partition[path->part].fatfs, &buf->pvt.fat.fh, dent->pvt.fat.realname, FA_WRITE | FA_READ | FA_OPEN_EXISTING);
     if (res == FR_OK) {
@@ -785,6 +1140,10 @@ int8_t fat_readdir(dh_t *dh, cbmdirent_t *dent) {
   finfo.lfn = entrybuf;
 
   do {
+#ifdef CONFIG_SCRATCH_BATCH
+    lastentry.part = dh->part;
+    lastentry.dir  = dh->dir.fat;
+#endif
     res = f_readdir(&dh->dir.fat, &finfo);
     if (res != FR_OK) {
       if (res == FR_INVALID_OBJECT)
@@ -835,13 +1194,16 @@ int8_t fat_readdir(dh_t *dh, cbmdirent_t *dent) {
         memcpy(dent->name, name, CBM_NAME_LENGTH);
       } else {
         /* read name from file */
+        FIL  *fh = scratch_get(dh->part);
         UINT bytesread;
 
-        res = l_opencluster(&partition[dh->part].fatfs, &partition[dh->part].imagehandle, finfo.clust);
-        if (res != FR_OK)
-          goto notp00;
+        if (fh == NULL)
+          return 1;
 
-        res = f_read(&partition[dh->part].imagehandle, entrybuf, P00_HEADER_SIZE, &bytesread);
+        res = l_opencluster(&partition[dh->part].fatfs, fh, finfo.clust);
+        if (res == FR_OK)
+          res = f_read(fh, entrybuf, P00_HEADER_SIZE, &bytesread);
+        scratch_put(fh);
         if (res != FR_OK)
           goto notp00;
 
@@ -947,6 +1309,9 @@ int8_t fat_readdir(dh_t *dh, cbmdirent_t *dent) {
  *
  * This function deletes the file filename in path and returns
  * 0 if not found, 1 if deleted or 255 if an error occured.
+ * While SCRATCH_BATCH is set in globalflags, a file just returned by
+ * fat_readdir is deleted at its directory position instead of searching
+ * for its name again and the file system is synced by fat_delete_commit.
  */
 uint8_t fat_delete(path_t *path, cbmdirent_t *dent) {
   FRESULT res;
@@ -960,8 +1325,28 @@ uint8_t fat_delete(path_t *path, cbmdirent_t *dent) {
     name = dent->name;
     pet2asc(name);
   }
+  d64_mountcache_invalidate();
+  if (image_slot_release(path->part, dent->pvt.fat.cluster)) {
+    update_leds();
+    return 255;
+  }
   partition[path->part].fatfs.curr_dir = path->dir.fat;
-  res = f_unlink(&partition[path->part].fatfs, name);
+
+#ifdef CONFIG_SCRATCH_BATCH
+  if ((globalflags & SCRATCH_BATCH) && lastentry.part == path->part) {
+    if (unsynced_part != path->part && fat_delete_commit()) {
+      update_leds();
+      return 255;
+    }
+
+    unsynced_part  = path->part;
+    lastentry.part = 255;
+    res = l_unlink(&lastentry.dir, dent->pvt.fat.cluster);
+    if (res == FR_NO_FILE)
+      res = f_unlink(&partition[path->part].fatfs, name);
+  } else
+#endif
+    res = f_unlink(&partition[path->part].fatfs, name);
 
   update_leds();
 
@@ -974,6 +1359,30 @@ uint8_t fat_delete(path_t *path, cbmdirent_t *dent) {
     return 255;
 }
 
+#ifdef CONFIG_SCRATCH_BATCH
+/**
+ * fat_delete_commit - sync the file system after a batched scratch
+ *
+ * This function writes back the directory and FAT changes that
+ * fat_delete left in the cache while SCRATCH_BATCH was set.
+ * Returns 0 if successful, 1 on error.
+ */
+uint8_t fat_delete_commit(void) {
+  FRESULT res;
+
+  if (unsynced_part == 255)
+    return 0;
+
+  res = l_sync(&partition[unsynced_part].fatfs);
+  unsynced_part = 255;
+  if (res != FR_OK) {
+    parse_error(res,0);
+    return 1;
+  }
+  return 0;
+}
+#endif
+
 /**
  * fat_chdir - change directory in FAT and/or mount image
  * @path: path object for the location of dirname
@@ -1020,30 +1429,42 @@ uint8_t fat_chdir(path_t *path, cbmdirent_t *dent) {
     if (check_imageext(dent->pvt.fat.realname) != IMG_UNKNOWN) {
       /* D64/M2I mount request */
       free_multiple_buffers(FMB_USER_CLEAN);
+      if (image_slot_release(path->part, dent->pvt.fat.cluster) ||
+          image_handle_get(path->part))
+        return 1;
+
       /* Open image file */
       res = f_open(&partition[path->part].fatfs,
-                   &partition[path->part].imagehandle,
+                   image_handle(path->part),
                    dent->pvt.fat.realname, FA_OPEN_EXISTING|FA_READ|FA_WRITE);
 
       /* Try to open read-only if medium or file is read-only */
       if (res == FR_DENIED || res == FR_WRITE_PROTECTED)
         res = f_open(&partition[path->part].fatfs,
-                     &partition[path->part].imagehandle,
+                     image_handle(path->part),
                      dent->pvt.fat.realname, FA_OPEN_EXISTING|FA_READ);
 
       if (res != FR_OK) {
+        image_handle_put(path->part);
         parse_error(res,1);
         return 1;
       }
 
+#ifdef CONFIG_IMAGE_DIRECT_LBA
+      partition[path->part].imagelba =
+        l_contiguous(image_handle(path->part));
+#endif
+
 #ifdef CONFIG_M2I
       if (check_imageext(dent->pvt.fat.realname) == IMG_IS_M2I)
         partition[path->part].fop = &m2iops;
       else
 #endif
         {
-          if (d64_mount(path))
+          if (d64_mount(path)) {
+            image_handle_put(path->part);
             return 1;
+          }
           partition[path->part].fop = &d64ops;
         }
 
@@ -1232,6 +1653,7 @@ void fat_sectordummy(buffer_t *buf, uint8_t part, uint8_t track, uint8_t sector)
  */
 void fat_rename(path_t *path, cbmdirent_t *dent, uint8_t *newname) {
   uint8_t *ext;
+  FIL     *fh;
   FRESULT res;
   UINT byteswritten;
 
@@ -1241,34 +1663,28 @@ void fat_rename(path_t *path, cbmdirent_t *dent, uint8_t *newname) {
     /* [PSUR]00 rename, just change the internal file name */
     p00cache_invalidate();
 
-    res = f_open(&partition[path->part].fatfs, &partition[path->part].imagehandle,
-                 dent->pvt.fat.realname, FA_WRITE|FA_OPEN_EXISTING);
-    if (res != FR_OK) {
-      parse_error(res,0);
+    fh = scratch_get(path->part);
+    if (fh == NULL)
       return;
-    }
 
-    res = f_lseek(&partition[path->part].imagehandle, P00_CBMNAME_OFFSET);
-    if (res != FR_OK) {
-      parse_error(res,0);
-      return;
-    }
+    res = f_open(&partition[path->part].fatfs, fh,
+                 dent->pvt.fat.realname, FA_WRITE|FA_OPEN_EXISTING);
+    if (res == FR_OK)
+      res = f_lseek(fh, P00_CBMNAME_OFFSET);
 
-    /* Copy the new name into dent->name so we can overwrite all 16 bytes */
-    memset(dent->name, 0, CBM_NAME_LENGTH);
-    ustrcpy(dent->name, newname);
+    if (res == FR_OK) {
+      /* Copy the new name into dent->name so we can overwrite all 16 bytes */
+      memset(dent->name, 0, CBM_NAME_LENGTH);
+      ustrcpy(dent->name, newname);
 
-    res = f_write(&partition[path->part].imagehandle, dent->name, CBM_NAME_LENGTH, &byteswritten);
-    if (res != FR_OK || byteswritten != CBM_NAME_LENGTH) {
-      parse_error(res,0);
-      return;
+      res = f_write(fh, dent->name, CBM_NAME_LENGTH, &byteswritten);
+      if (res == FR_OK && byteswritten == CBM_NAME_LENGTH)
+        res = f_close(fh);
     }
 
-    res = f_close(&partition[path->part].imagehandle);
-    if (res != FR_OK) {
+    scratch_put(fh);
+    if (res != FR_OK)
       parse_error(res,0);
-      return;
-    }
   } else {
     switch (check_extension(dent->pvt.fat.realname, &ext)) {
     case EXT_IS_TYPE:
@@ -1292,6 +1708,111 @@ void fat_rename(path_t *path, cbmdirent_t *dent, uint8_t *newname) {
   }
 }
 
+#ifdef CONFIG_DEFRAG
+/**
+ * fat_fragments - report or remove the fragmentation of a file
+ * @path  : path of the file
+ * @dent  : file to be checked, NULL for the image mounted on @path->part
+ * @defrag: Flags if the file should be moved into consecutive clusters
+ *
+ * This function reports the number of cluster runs of a file on FAT
+ * as track and sector of the OK message. If @defrag is set, the file
+ * is copied into a free run of consecutive clusters first. The copy is
+ * completed before the directory entry is switched to it, so a power
+ * loss can only leave unused clusters behind. All user channels are
+ * closed before a file is moved.
+ */
+void fat_fragments(path_t *path, cbmdirent_t *dent, uint8_t defrag) {
+  uint8_t part = path->part;
+  FIL     *fh;
+  uint8_t *name;
+  FRESULT res;
+  DWORD   frags;
+
+  if (dent == NULL) {
+    /* mounted image */
+    if (partition[part].fop == &fatops) {
+      set_error(ERROR_SYNTAX_NONAME);
+      return;
+    }
+
+    fh = image_handle(part);
+
+    if (defrag) {
+      free_multiple_buffers(FMB_USER_CLEAN);
+      d64_bam_commit();
+    }
+  } else {
+    /* file on FAT, opened through a handle of its own */
+    if (partition[part].fop != &fatops ||
+        (dent->typeflags & TYPE_MASK) == TYPE_DIR) {
+      set_error(ERROR_FILE_TYPE_MISMATCH);
+      return;
+    }
+
+    if (defrag) {
+      free_multiple_buffers(FMB_USER_CLEAN);
+      if (image_slot_release(part, dent->pvt.fat.cluster))
+        return;
+    }
+
+    if (dent->pvt.fat.realname[0]) {
+      name = dent->pvt.fat.realname;
+    } else {
+      name = dent->name;
+      pet2asc(name);
+    }
+
+    fh = scratch_get(part);
+    if (fh == NULL)
+      return;
+
+    partition[part].fatfs.curr_dir = path->dir.fat;
+    res = f_open(&partition[part].fatfs, fh, name,
+                 FA_OPEN_EXISTING | FA_READ | (defrag ? FA_WRITE : 0));
+    if (res != FR_OK) {
+      scratch_put(fh);
+      parse_error(res, !defrag);
+      return;
+    }
+  }
+
+  if (defrag) {
+    set_dirty_led(1);
+    res = l_defrag(fh);
+    update_leds();
+
+    if (dent == NULL) {
+      imagepair_invalidate();
+#ifdef CONFIG_IMAGE_DIRECT_LBA
+      partition[part].imagelba = l_contiguous(fh);
+#endif
+    } else {
+      p00cache_invalidate();
+      d64_mountcache_invalidate();
+    }
+  } else
+    res = FR_OK;
+
+  if (res == FR_OK)
+    res = l_fragments(fh, &frags);
+
+  if (dent != NULL) {
+    f_close(fh);
+    scratch_put(fh);
+  }
+
+  if (res != FR_OK) {
+    parse_error(res, !defrag);
+    return;
+  }
+
+  if (frags > 0xffff)
+    frags = 0xffff;
+  set_error_ts(ERROR_OK, frags >> 8, frags & 0xff);
+}
+#endif
+
 /**
  * fatops_init - Initialize fatops module
  * @preserve_path: Preserve the current directory if non-zero
@@ -1304,6 +1825,28 @@ void fatops_init(uint8_t preserve_path) {
   FRESULT res;
   uint8_t realdrive,drive,part;
 
+#ifdef CONFIG_IMAGE_SLOTS
+  /* Forget images mounted in slots, the medium may have changed */
+  for (part = FIRST_IMAGE_SLOT; part < PARTITION_COUNT; part++) {
+    partition[part].fop = &fatops;
+#  ifdef CONFIG_IMAGE_DIRECT_LBA
+    partition[part].imagelba = 0;
+#  endif
+  }
+  for (part = 0; part < CONFIG_IMAGE_SLOTS; part++)
+    slotorder[part] = FIRST_IMAGE_SLOT + part;
+#endif
+
+#ifdef CONFIG_SCRATCH_BATCH
+  lastentry.part = 255;
+#endif
+
+#ifdef CONFIG_IMAGE_HANDLES
+  /* Images are mounted again on the new medium */
+  for (part = 0; part < PARTITION_COUNT; part++)
+    image_handle_put(part);
+#endif
+
   max_part = 0;
   drive = 0;
   part = 0;
@@ -1341,6 +1884,7 @@ void fatops_init(uint8_t preserve_path) {
   /* Invalidate some caches */
   d64_invalidate();
   p00cache_invalidate();
+  imagepair_invalidate();
 
 #ifndef HAVE_HOTPLUG
   if (!max_part) {
@@ -1363,6 +1907,7 @@ uint8_t image_unmount(uint8_t part) {
   FRESULT res;
 
   free_multiple_buffers(FMB_USER_CLEAN);
+  imagepair_invalidate();
 
   /* call D64 unmount function to handle BAM refcounting etc. */
   // FIXME: ops entry?
@@ -1380,7 +1925,11 @@ uint8_t image_unmount(uint8_t part) {
   }
 
   partition[part].fop = &fatops;
-  res = f_close(&partition[part].imagehandle);
+#ifdef CONFIG_IMAGE_DIRECT_LBA
+  partition[part].imagelba = 0;
+#endif
+  res = f_close(image_handle(part));
+  image_handle_put(part);
   if (res != FR_OK) {
     parse_error(res,0);
     return 1;
@@ -1418,6 +1967,271 @@ void image_mkdir(path_t *path, uint8_t *dirname) {
   return;
 }
 
+#ifdef CONFIG_IMAGE_SLOTS
+/**
+ * slot_unmount - unmount the image in an image slot
+ * @slot: partition number of the slot
+ *
+ * This function unmounts the disk image in an image slot. Unlike
+ * image_unmount it does not close any files, the caller must make sure
+ * that no buffer accesses the image (see d64_image_busy).
+ */
+static void slot_unmount(uint8_t slot) {
+  if (partition[slot].fop == &fatops)
+    return;
+
+  d64_unmount(slot);
+  imagepair_invalidate();
+  partition[slot].fop = &fatops;
+#ifdef CONFIG_IMAGE_DIRECT_LBA
+  partition[slot].imagelba = 0;
+#endif
+  f_close(image_handle(slot));
+  image_handle_put(slot);
+}
+
+/**
+ * image_slot_release - unmount an image file from the image slots
+ * @part   : partition of the image file
+ * @cluster: start cluster of the image file
+ *
+ * This function must be called before an image file is modified or
+ * mounted on FAT to make sure it is not accessed through two handles.
+ * Returns 0 if successful or 1 with NO CHANNEL set if a file is still
+ * open in the image.
+ */
+static uint8_t image_slot_release(uint8_t part, DWORD cluster) {
+  uint8_t slot;
+
+  for (slot = FIRST_IMAGE_SLOT; slot < PARTITION_COUNT; slot++)
+    if (partition[slot].fop != &fatops &&
+        slotowner[slot - FIRST_IMAGE_SLOT] == part &&
+        image_handle(slot)->org_clust == cluster) {
+      if (d64_image_busy(slot)) {
+        set_error(ERROR_NO_CHANNEL);
+        return 1;
+      }
+      slot_unmount(slot);
+    }
+
+  return 0;
+}
+
+/**
+ * image_slot_owner - return the partition an image file is stored on
+ * @part: partition number
+ *
+ * This function returns the partition that holds the image file mounted
+ * in the image slot @part. Other partitions are returned unchanged.
+ */
+uint8_t image_slot_owner(uint8_t part) {
+  if (is_image_slot(part))
+    return slotowner[part - FIRST_IMAGE_SLOT];
+  else
+    return part;
+}
+
+/**
+ * slot_touch - mark an image slot as most recently used
+ * @slot: partition number of the slot
+ */
+static void slot_touch(uint8_t slot) {
+  uint8_t i = 0;
+
+  while (slotorder[i] != slot)
+    i++;
+
+  while (i > 0) {
+    slotorder[i] = slotorder[i-1];
+    i--;
+  }
+
+  slotorder[0] = slot;
+}
+
+/**
+ * image_slot_mount - mount a disk image that is a component of a path
+ * @path: path of the image file, changed to its root directory
+ * @dent: directory entry of the image file
+ *
+ * This function mounts the Dxx image in @dent in one of the image slots,
+ * so the rest of a path can refer to files inside it while the image
+ * mounted on the partition stays untouched. Images stay mounted after
+ * the command, an image that is already mounted in a slot is used again.
+ * Otherwise a free slot is used or the least recently used slot without
+ * open files is replaced. Returns 0 if successful, 1 otherwise.
+ */
+uint8_t image_slot_mount(path_t *path, cbmdirent_t *dent) {
+  FATFS   *fs = &partition[path->part].fatfs;
+  uint8_t slot, i;
+  FRESULT res;
+
+  if (partition[path->part].fop != &fatops ||
+      check_imageext(dent->pvt.fat.realname) != IMG_IS_DISK) {
+    set_error(ERROR_FILE_NOT_FOUND_39);
+    return 1;
+  }
+
+  /* Check if the image is mounted already */
+  for (slot = FIRST_IMAGE_SLOT; slot < PARTITION_COUNT; slot++)
+    if (partition[slot].fop != &fatops &&
+        slotowner[slot - FIRST_IMAGE_SLOT] == path->part &&
+        image_handle(slot)->org_clust == dent->pvt.fat.cluster)
+      goto found;
+
+  /* Look for a free slot */
+  for (slot = FIRST_IMAGE_SLOT; slot < PARTITION_COUNT; slot++)
+    if (partition[slot].fop == &fatops)
+      break;
+
+  if (slot == PARTITION_COUNT) {
+    /* Replace the least recently used slot without open files */
+    i = CONFIG_IMAGE_SLOTS;
+    do {
+      if (i == 0) {
+        set_error(ERROR_NO_CHANNEL);
+        return 1;
+      }
+      slot = slotorder[--i];
+    } while (d64_image_busy(slot));
+
+    slot_unmount(slot);
+  }
+
+  if (image_handle_get(slot))
+    return 1;
+
+  fs->curr_dir = path->dir.fat;
+  res = f_open(fs, image_handle(slot), dent->pvt.fat.realname,
+               FA_OPEN_EXISTING|FA_READ|FA_WRITE);
+
+  /* Try to open read-only if medium or file is read-only */
+  if (res == FR_DENIED || res == FR_WRITE_PROTECTED)
+    res = f_open(fs, image_handle(slot), dent->pvt.fat.realname,
+                 FA_OPEN_EXISTING|FA_READ);
+
+  if (res != FR_OK) {
+    image_handle_put(slot);
+    parse_error(res,1);
+    return 1;
+  }
+
+#ifdef CONFIG_IMAGE_DIRECT_LBA
+  partition[slot].imagelba = l_contiguous(image_handle(slot));
+#endif
+
+  slotowner[slot - FIRST_IMAGE_SLOT] = path->part;
+  path->part = slot;
+  if (d64_mount(path)) {
+    f_close(image_handle(slot));
+    image_handle_put(slot);
+    return 1;
+  }
+
+  partition[slot].fop         = &d64ops;
+  partition[slot].current_dir = path->dir;
+
+ found:
+  slot_touch(slot);
+  path->part = slot;
+  path->dir  = partition[slot].current_dir;
+  return 0;
+}
+#endif
+
+#ifdef CONFIG_IMAGE_DIRECT_LBA
+/**
+ * image_direct - access a contiguous image file without FatFs
+ * @part  : partition number
+ * @offset: offset in the image file
+ * @buffer: pointer to the data
+ * @bytes : number of bytes to transfer
+ * @write : Flags if the data should be written instead of read
+ *
+ * This function transfers data between @buffer and an image file that
+ * is stored in consecutive clusters with direct calls to disk_read
+ * and disk_write. Complete card sectors are transferred in one command,
+ * partial card sectors are handled through the image pair buffer.
+ * Returns 0 on success or 2 on failure.
+ */
+static uint8_t image_direct(uint8_t part, DWORD offset, uint8_t *buffer,
+                            uint16_t bytes, uint8_t write) {
+  BYTE     drive  = image_handle(part)->fs->drive;
+  DWORD    sector = partition[part].imagelba + offset / 512;
+  uint16_t start  = offset & 511;
+  uint16_t len;
+  DRESULT  res;
+
+  while (bytes) {
+    if (start == 0 && bytes >= 512) {
+      /* complete card sectors */
+      BYTE count = bytes / 512;
+
+      len = count * 512;
+      if (imagepair.part == part &&
+          imagepair.offset >= (offset & ~511UL) &&
+          imagepair.offset <  (offset & ~511UL) + len)
+        imagepair_invalidate();
+
+      if (write)
+        res = disk_write(drive, buffer, sector, count);
+      else
+        res = disk_read(drive, buffer, sector, count);
+
+      sector += count;
+    } else {
+      /* partial card sector */
+      DWORD base = offset & ~511UL;
+
+      len = 512 - start;
+      if (len > bytes)
+        len = bytes;
+
+      res = RES_OK;
+      if (imagepair.part != part || imagepair.offset != base) {
+        imagepair.part = 255;
+        res = disk_read(drive, imagepair.data, sector, 1);
+        if (res == RES_OK) {
+          imagepair.part   = part;
+          imagepair.offset = base;
+          imagepair.length = image_handle(part)->fsize - base;
+          if (imagepair.length > 512)
+            imagepair.length = 512;
+        }
+      }
+
+      if (res == RES_OK) {
+        if (write) {
+          memcpy(imagepair.data + start, buffer, len);
+          res = disk_write(drive, imagepair.data, sector, 1);
+          if (res != RES_OK)
+            imagepair_invalidate();
+        } else
+          memcpy(buffer, imagepair.data + start, len);
+      }
+
+      sector++;
+      start = 0;
+    }
+
+    if (res != RES_OK) {
+      parse_error(FR_RW_ERROR, !write);
+      return 2;
+    }
+
+    offset += len;
+    buffer += len;
+    bytes  -= len;
+  }
+
+  if (write)
+    /* let f_sync/f_close update the directory entry */
+    image_handle(part)->flag |= FA__WRITTEN;
+
+  return 0;
+}
+#endif
+
 /**
  * image_read - Seek to a specified image offset and read data
  * @part  : partition number
@@ -1428,20 +2242,60 @@ void image_mkdir(path_t *path, uint8_t *dirname) {
  * This function seeks to offset in the image file and reads bytes
  * byte into buffer. It returns 0 on success, 1 if less than
  * bytes byte could be read and 2 on failure.
+ * With CONFIG_IMAGE_PAIR_BUFFER, reads within a single 512-byte card
+ * sector fetch the complete card sector, so the second image sector
+ * stored in it can be returned later without accessing FatFs.
+ * The file position after such a read is undefined.
+ * With CONFIG_IMAGE_DIRECT_LBA, images stored in consecutive clusters
+ * are read directly from the card without FatFs.
  */
 uint8_t image_read(uint8_t part, DWORD offset, void *buffer, uint16_t bytes) {
   FRESULT res;
   UINT bytesread;
 
+#ifdef CONFIG_IMAGE_DIRECT_LBA
+  if (partition[part].imagelba && offset != -1 &&
+      offset + bytes <= image_handle(part)->fsize)
+    return image_direct(part, offset, buffer, bytes, 0);
+#endif
+
+#ifdef CONFIG_IMAGE_PAIR_BUFFER
+  DWORD base = offset & ~511UL;
+
+  if (offset != -1 && bytes != 0 && base == ((offset + bytes - 1) & ~511UL)) {
+    if (imagepair.part != part || imagepair.offset != base) {
+      imagepair.part = 255;
+
+      res = f_lseek(image_handle(part), base);
+      if (res == FR_OK)
+        res = f_read(image_handle(part), imagepair.data, 512,
+                     &imagepair.length);
+      if (res != FR_OK) {
+        parse_error(res,1);
+        return 2;
+      }
+
+      imagepair.part   = part;
+      imagepair.offset = base;
+    }
+
+    if (offset - base + bytes > imagepair.length)
+      return 1;
+
+    memcpy(buffer, imagepair.data + (offset - base), bytes);
+    return 0;
+  }
+#endif
+
   if (offset != -1) {
-    res = f_lseek(&partition[part].imagehandle, offset);
+    res = f_lseek(image_handle(part), offset);
     if (res != FR_OK) {
       parse_error(res,1);
       return 2;
     }
   }
 
-  res = f_read(&partition[part].imagehandle, buffer, bytes, &bytesread);
+  res = f_read(image_handle(part), buffer, bytes, &bytesread);
   if (res != FR_OK) {
     parse_error(res,1);
     return 2;
@@ -1464,34 +2318,73 @@ uint8_t image_read(uint8_t part, DWORD offset, void *buffer, uint16_t bytes) {
  * This function seeks to offset in the image file and writes bytes
  * byte into buffer. It returns 0 on success, 1 if less than
  * bytes byte could be written and 2 on failure.
+ * Writes within a contiguous image are done directly as in image_read.
  */
 uint8_t image_write(uint8_t part, DWORD offset, void *buffer, uint16_t bytes, uint8_t flush) {
   FRESULT res;
   UINT byteswritten;
 
+#ifdef CONFIG_IMAGE_DIRECT_LBA
+  if (partition[part].imagelba && offset != -1 &&
+      (image_handle(part)->flag & FA_WRITE) &&
+      offset + bytes <= image_handle(part)->fsize) {
+    if (image_direct(part, offset, buffer, bytes, 1))
+      return 2;
+
+    if (flush)
+      f_sync(image_handle(part));
+
+    return 0;
+  }
+#endif
+
+#ifdef CONFIG_IMAGE_PAIR_BUFFER
+  if (imagepair.part == part &&
+      (offset == -1 || (offset < imagepair.offset + 512 &&
+                        offset + bytes > imagepair.offset)))
+    imagepair_invalidate();
+#endif
+
   if (offset != -1) {
-    res = f_lseek(&partition[part].imagehandle, offset);
+    res = f_lseek(image_handle(part), offset);
     if (res != FR_OK) {
       parse_error(res,0);
       return 2;
     }
   }
 
-  res = f_write(&partition[part].imagehandle, buffer, bytes, &byteswritten);
+  res = f_write(image_handle(part), buffer, bytes, &byteswritten);
   if (res != FR_OK) {
     parse_error(res,1);
     return 2;
   }
 
+#ifdef CONFIG_IMAGE_DIRECT_LBA
+  /* The file may have grown into a non-consecutive cluster */
+  if (partition[part].imagelba)
+    partition[part].imagelba = l_contiguous(image_handle(part));
+#endif
+
   if (byteswritten != bytes)
     return 1;
 
   if (flush)
-    f_sync(&partition[part].imagehandle);
+    f_sync(image_handle(part));
 
   return 0;
 }
 
+/**
+ * image_sync - Flush buffered writes of an image file
+ * @part: partition number
+ *
+ * This function flushes all data written to the image file
+ * of the partition to the storage medium.
+ */
+void image_sync(uint8_t part) {
+  f_sync(image_handle(part));
+}
+
 /* Dummy function for format */
 void format_dummy(uint8_t drive, uint8_t *name, uint8_t *id) {
   set_error(ERROR_SYNTAX_UNKNOWN);
@@ -47,6 +47,24 @@ int8_t   fat_readdir(dh_t *dh, cbmdirent_t *dent);
 void     fat_sectordummy(buffer_t *buf, uint8_t part, uint8_t track, uint8_t sector);
 void     format_dummy(uint8_t drive, uint8_t *name, uint8_t *id);
 
+#ifdef CONFIG_IMAGE_SLOTS
+/* mount a disk image in a path without changing the current image */
+uint8_t  image_slot_mount(path_t *path, cbmdirent_t *dent);
+uint8_t  image_slot_owner(uint8_t part);
+#else
+#  define image_slot_owner(part) (part)
+#endif
+
+#ifdef CONFIG_SCRATCH_BATCH
+/* sync the file system after a batched scratch */
+uint8_t  fat_delete_commit(void);
+#endif
+
+#ifdef CONFIG_DEFRAG
+/* report or remove the fragmentation of a file or the mounted image */
+void     fat_fragments(path_t *path, cbmdirent_t *dent, uint8_t defrag);
+#endif
+
 extern const fileops_t fatops;
 extern uint8_t file_extension_mode;
 
@@ -56,6 +74,7 @@ uint8_t image_chdir(path_t *path, cbmdirent_t *dent);
 void    image_mkdir(path_t *path, uint8_t *dirname);
 uint8_t image_read(uint8_t part, DWORD offset, void *buffer, uint16_t bytes);
 uint8_t image_write(uint8_t part, DWORD offset, void *buffer, uint16_t bytes, uint8_t flush);
+void    image_sync(uint8_t part);
 
 typedef enum { IMG_UNKNOWN, IMG_IS_M2I, IMG_IS_DISK } imgtype_t;
 
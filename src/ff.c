@@ -1539,6 +1539,159 @@ FRESULT l_opencluster (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Get the first sector of a file stored in consecutive clusters         */
+/*-----------------------------------------------------------------------*/
+
+DWORD l_contiguous (   /* First sector of the file, 0: fragmented or error */
+  FIL *fp              /* Pointer to the file object */
+)
+{
+  FATFS *fs = fp->fs;
+  DWORD clust = fp->org_clust, next, links;
+
+
+  if (clust < 2 || fp->fsize == 0) return 0;
+
+  links = (fp->fsize - 1) / ((DWORD)fs->csize * SS(fs));
+  while (links--) {                   /* Follow the chain to the last cluster */
+    next = get_cluster(fs, clust);
+    if (next != clust + 1) return 0;  /* Fragmented or error */
+    clust = next;
+  }
+
+  /* The caller bypasses the buffer, so write it back and drop it */
+  if (!move_fp_window(fp, 0)) return 0;
+  FPBUF.sect = 0;
+
+  return clust2sect(fs, fp->org_clust);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Count the runs of consecutive clusters of a file                      */
+/*-----------------------------------------------------------------------*/
+
+FRESULT l_fragments (
+  FIL *fp,             /* Pointer to the file object */
+  DWORD *frags         /* Pointer to the variable to return the count */
+)
+{
+  FRESULT res;
+  FATFS *fs = fp->fs;
+  DWORD clust = fp->org_clust, next, links;
+
+
+  *frags = 0;
+  res = validate(fs /*, fp->id*/);    /* Check validity of the object */
+  if (res != FR_OK) return res;
+  if (clust == 0 || fp->fsize == 0) return FR_OK;
+
+  *frags = 1;
+  links = (fp->fsize - 1) / ((DWORD)fs->csize * SS(fs));
+  while (links--) {
+    next = get_cluster(fs, clust);
+    if (next < 2 || next >= fs->max_clust) return FR_RW_ERROR;
+    if (next != clust + 1) (*frags)++;
+    clust = next;
+  }
+  return FR_OK;
+}
+
+
+
+#if !_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Move a file into consecutive clusters                                 */
+/*-----------------------------------------------------------------------*/
+
+FRESULT l_defrag (
+  FIL *fp              /* Pointer to the file object opened for writing */
+)
+{
+  FRESULT res;
+  FATFS *fs = fp->fs;
+  DWORD frags, count, run, clust, scl, sect, nsect, left;
+  BYTE n, *dir;
+
+
+  if (!(fp->flag & FA_WRITE)) return FR_WRITE_PROTECTED;
+  res = f_sync(fp);
+  if (res == FR_OK) res = l_fragments(fp, &frags);
+  if (res != FR_OK || frags <= 1) return res;
+
+  /* Find the first run of free clusters that can hold the file */
+  count = (fp->fsize - 1) / ((DWORD)fs->csize * SS(fs)) + 1;
+  run = scl = 0;
+  for (clust = 2; clust < fs->max_clust && run < count; clust++) {
+    switch (get_cluster(fs, clust)) {
+    case 0:
+      if (!run) scl = clust;
+      run++;
+      break;
+    case 1:
+      return FR_RW_ERROR;
+    default:
+      run = 0;
+    }
+  }
+  if (run < count) return FR_DENIED;
+
+  /* Allocate the new chain, the file still uses the old one */
+  for (clust = scl; clust < scl + count - 1; clust++)
+    if (!put_cluster(fs, clust, clust + 1)) goto fd_error;
+  if (!put_cluster(fs, clust, 0x0FFFFFFF)) goto fd_error;
+  fs->last_clust = clust;
+  if (fs->free_clust != 0xFFFFFFFF) {
+    fs->free_clust -= count;
+#if _USE_FSINFO
+    fs->fsi_flag = 1;
+#endif
+  }
+
+  /* Copy the contents */
+  left  = (fp->fsize + SS(fs) - 1) / SS(fs);
+  clust = fp->org_clust;
+  nsect = clust2sect(fs, scl);
+  for (;;) {
+    sect = clust2sect(fs, clust);
+    for (n = fs->csize; n && left; n--, left--)
+      if (!move_fp_window(fp, sect++) ||
+          disk_write(fs->drive, FPBUF.data, nsect++, 1) != RES_OK)
+        goto fd_error;
+    if (!left) break;
+    clust = get_cluster(fs, clust);
+    if (clust < 2 || clust >= fs->max_clust) goto fd_error;
+  }
+
+  /* Switch the directory entry to the new chain with a single write */
+  if (!move_fs_window(fs, fp->dir_sect)) goto fd_error;
+  dir = fp->dir_ptr;
+  ST_WORD(&dir[DIR_FstClusLO], scl);
+  ST_WORD(&dir[DIR_FstClusHI], scl >> 16);
+  FSBUF.dirty = TRUE;
+  if (!move_fs_window(fs, 0)) return FR_RW_ERROR;
+
+  /* Release the old chain, a failure only leaves lost clusters */
+  clust = fp->org_clust;
+  fp->org_clust = scl;
+  fp->fptr = 0;
+  fp->csect = 1;
+  FPBUF.sect = 0;
+  if (!remove_chain(fs, clust)) return FR_RW_ERROR;
+  return sync(fs);
+
+fd_error: /* Abort, the old chain is still intact */
+  remove_chain(fs, scl);
+  sync(fs);
+  return FR_RW_ERROR;
+}
+#endif
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Read File                                                             */
 /*-----------------------------------------------------------------------*/
@@ -2330,6 +2483,82 @@ FRESULT f_unlink (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Delete the next file of an open directory                             */
+/*-----------------------------------------------------------------------*/
+
+FRESULT l_unlink (
+  const DIR *dj,       /* Directory object as passed to f_readdir */
+  DWORD clust          /* Start cluster of the file returned by f_readdir */
+)
+{
+  FRESULT res;
+  FATFS *fs = dj->fs;
+  DIR scan, mark;
+  BYTE *dir, c;
+  DWORD dclust;
+
+
+  res = validate(fs /*, dj->id*/);    /* Check validity of the object */
+  if (res != FR_OK) return res;
+
+  /* Find the short entry that f_readdir returned from this position */
+  scan = *dj;
+  while (1) {
+    if (!scan.sect) return FR_NO_FILE;
+    if (!move_fs_window(fs, scan.sect)) return FR_RW_ERROR;
+    dir = &FSBUF.data[(scan.index & ((SS(fs) - 1) >> 5)) * 32];
+    c = dir[DIR_Name];
+    if (c == 0) return FR_NO_FILE;
+    if (c != 0xE5 && (dir[DIR_Attr] & AM_LFN) != AM_LFN) break;
+    if (!next_dir_entry(&scan)) return FR_NO_FILE;
+  }
+
+  /* Only delete files and only the one that was returned */
+  if (dir[DIR_Attr] & (AM_DIR | AM_VOL)) return FR_NO_FILE;
+  if (dir[DIR_Attr] & AM_RDO) return FR_DENIED;
+  dclust = ((DWORD)LD_WORD(&dir[DIR_FstClusHI]) << 16) | LD_WORD(&dir[DIR_FstClusLO]);
+  if (dclust != clust) return FR_NO_FILE;
+
+  /* Mark its long name entries and the short entry 'deleted' */
+  mark = *dj;
+  while (1) {
+    if (!move_fs_window(fs, mark.sect)) return FR_RW_ERROR;
+    dir = &FSBUF.data[(mark.index & ((SS(fs) - 1) >> 5)) * 32];
+    if (dir[DIR_Name] != 0xE5) {
+      dir[DIR_Name] = 0xE5;
+      FSBUF.dirty = TRUE;
+    }
+    if (mark.index == scan.index) break;
+    if (!next_dir_entry(&mark)) return FR_RW_ERROR;
+  }
+
+  if (!remove_chain(fs, dclust)) return FR_RW_ERROR;  /* Remove the cluster chain */
+  return FR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Write back the cached data of a file system                           */
+/*-----------------------------------------------------------------------*/
+
+FRESULT l_sync (
+  FATFS *fs            /* Pointer to the file system object */
+)
+{
+  FRESULT res;
+
+
+  res = validate(fs);
+  if (res != FR_OK) return res;
+  return sync(fs);
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Create a Directory                                                    */
 /*-----------------------------------------------------------------------*/
@@ -314,6 +314,11 @@ FRESULT f_chdir (const UCHAR*);                             /* Change current di
 /* Low Level functions */
 FRESULT l_opendir(FATFS* fs, DWORD cluster, DIR *dirobj);   /* Open an existing directory by its start cluster */
 FRESULT l_opencluster(FATFS *fs, FIL *fp, DWORD clust);     /* Open a cluster by number as a read-only file */
+DWORD l_contiguous(FIL *fp);                                /* Get the first sector of a file in consecutive clusters */
+FRESULT l_fragments(FIL *fp, DWORD *frags);                 /* Count the runs of consecutive clusters of a file */
+FRESULT l_defrag(FIL *fp);                                  /* Move a file into consecutive clusters */
+FRESULT l_unlink(const DIR *dj, DWORD clust);               /* Delete the file f_readdir returns for a position, no sync */
+FRESULT l_sync(FATFS *fs);                                  /* Write back the cached data of a file system */
 FRESULT l_getfree (FATFS*, const UCHAR*, DWORD*, DWORD);    /* Get number of free clusters on the drive, limited */
 
 #if _USE_STRFUNC
@@ -451,7 +451,7 @@ static void load_directory(uint8_t secondary) {
 
   uint8_t *name;
 
-  buf->secondary = secondary;
+  set_buffer_secondary(buf, secondary);
   buf->read      = 1;
   buf->lastused  = 31;
 
@@ -630,7 +630,7 @@ scandone:
     memcpy_P(buf->data, dirheader, sizeof(dirheader));
 
     /* set partition number */
-    buf->data[HEADER_OFFSET_DRIVE] = path.part+1;
+    buf->data[HEADER_OFFSET_DRIVE] = image_slot_owner(path.part)+1;
 
     /* read directory name */
     if (dir_label(&path, buf->data+HEADER_OFFSET_NAME))
@@ -662,14 +662,14 @@ scandone:
 uint8_t directbuffer_refill(buffer_t *buf) {
   uint8_t sec = buf->secondary;
 
-  buf->secondary = BUFFER_SEC_CHAIN - sec;
+  set_buffer_secondary(buf, BUFFER_SEC_CHAIN - sec);
 
   if (buf->pvt.buffer.next == NULL)
     buf = buf->pvt.buffer.first;
   else
     buf = buf->pvt.buffer.next;
 
-  buf->secondary = sec;
+  set_buffer_secondary(buf, sec);
   buf->position  = 0;
   buf->mustflush = 0;
   return 0;
@@ -721,7 +721,7 @@ static void open_buffer(uint8_t secondary) {
       return;
 
     do {
-      buf->secondary = BUFFER_SEC_CHAIN - secondary;
+      set_buffer_secondary(buf, BUFFER_SEC_CHAIN - secondary);
       buf->refill    = directbuffer_refill;
       buf->cleanup   = largebuffer_cleanup;
       buf->read      = 1;
@@ -736,7 +736,7 @@ static void open_buffer(uint8_t secondary) {
     buf = prev->pvt.buffer.first;
 
     /* Set the first buffer as active by using the real secondary */
-    buf->secondary = secondary;
+    set_buffer_secondary(buf, secondary);
 
   } else {
     /* Normal buffer request */
@@ -745,7 +745,7 @@ static void open_buffer(uint8_t secondary) {
     if (!buf)
       return;
 
-    buf->secondary = secondary;
+    set_buffer_secondary(buf, secondary);
     buf->read      = 1;
     buf->position  = 1;  /* Sic! */
     buf->lastused  = 255;
@@ -980,7 +980,7 @@ void file_open(uint8_t secondary) {
   if (!buf)
     return;
 
-  buf->secondary = secondary;
+  set_buffer_secondary(buf, secondary);
 
   if(filetype == TYPE_REL) {
     display_filename_write(path.part,CBM_NAME_LENGTH,dent.name);
@@ -41,6 +41,8 @@ extern uint8_t globalflags;
 #define EXTENSION_HIDING (1<<3)
 #define POSTMATCH        (1<<4)
 #define FAT32_FREEBLOCKS (1<<5)
+#define CARD_INTERLEAVE  (1<<6)
+#define SCRATCH_BATCH    (1<<7)
 
 /* Disk image-as-directory mode, defined in fileops.c */
 extern uint8_t image_as_dir;
@@ -0,0 +1,49 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2007-2013  Ingo Korb <ingo@akana.de>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   iec-ll.h: Definitions for the interrupt-driven IEC byte transfers
+
+*/
+
+#ifndef IEC_LL_H
+#define IEC_LL_H
+
+#include "buffers.h"
+
+#ifdef CONFIG_IEC_ENGINE
+/* Receive a byte, returns -1 if the bus state has changed */
+int16_t iec_engine_getc(void);
+
+/* Send the rest of a buffer, returns 1 if the bus state has changed */
+uint8_t iec_engine_send(buffer_t *buf);
+
+/* Stop a running transfer and drop received bytes */
+void iec_engine_stop(void);
+
+/* Called from the interrupt handlers of ATN and the CLOCK/DATA timer */
+void iec_engine_atn(void);
+void iec_engine_irq(void);
+#else
+#  define iec_engine_stop() do {} while (0)
+#  define iec_engine_atn()  do {} while (0)
+#endif
+
+#endif
@@ -46,6 +46,7 @@
 #include "flags.h"
 #include "fileops.h"
 #include "iec-bus.h"
+#include "iec-ll.h"
 #include "led.h"
 #include "system.h"
 #include "timer.h"
@@ -105,6 +106,7 @@ IEC_ATN_HANDLER {
 /*  Byte transfer routines                                                   */
 /* ------------------------------------------------------------------------- */
 
+#ifndef CONFIG_IEC_ENGINE
 /**
  * _iec_getc - receive one byte from the CBM serial bus (E9C9)
  *
@@ -205,6 +207,9 @@ static int16_t iec_getc(void) {
   }
   return val;
 }
+#else
+#  define iec_getc() iec_engine_getc()
+#endif
 
 
 /**
@@ -303,6 +308,28 @@ static uint8_t iec_putc(uint8_t data, const uint8_t with_eoi) {
 /*  Listen+Talk-Handling                                                     */
 /* ------------------------------------------------------------------------- */
 
+#if defined(CONFIG_SPARE_BUFFERS) || defined(CONFIG_CHAIN_PREFETCH)
+/* Standard protocol without a speeder, the other side waits between bytes */
+#define STANDARD_TRANSFER() \
+  (!(iec_data.iecflags & (JIFFY_ACTIVE | JIFFY_LOAD | DOLPHIN_ACTIVE)))
+
+/**
+ * block_service - work on the buffers between two bytes
+ *
+ * This function reads the pending disk image prefetch and fills or writes
+ * the second data areas of the buffers while a transfer waits between two
+ * bytes. It is called once per block after the first byte, where the
+ * computer waits for the next handshake without a timeout. The ATN
+ * interrupt stays enabled for the whole listen and talk handling, so an
+ * ATN that arrives meanwhile is acknowledged as during any other card
+ * access.
+ */
+static void block_service(void) {
+  d64_prefetch_service();
+  spare_service();
+}
+#endif
+
 /**
  * iec_listen_handler - handle an incoming LISTEN request (EA2E)
  * @cmd: command byte received from the bus
@@ -372,6 +399,12 @@ static uint8_t iec_listen_handler(const uint8_t cmd) {
       if (buf->position == 0)
         buf->mustflush = 1;
 
+#if defined(CONFIG_SPARE_BUFFERS) || defined(CONFIG_CHAIN_PREFETCH)
+      /* Write the previous block while the talker waits */
+      if (buf->position == 3 && STANDARD_TRANSFER())
+        block_service();
+#endif
+
       /* REL files must be syncronized on EOI */
       if(buf->recordlen && (iec_data.iecflags & EOI_RECVD))
         if (buf->refill(buf))
@@ -418,6 +451,15 @@ static uint8_t iec_talk_handler(uint8_t cmd) {
   }
 
   while (buf->read) {
+#ifdef CONFIG_IEC_ENGINE
+    if (!(iec_data.iecflags & (JIFFY_LOAD | JIFFY_ACTIVE | DOLPHIN_ACTIVE))) {
+      /* Standard protocol, sent by the interrupt-driven engine */
+      if (iec_engine_send(buf)) {
+        uart_putc('V');
+        return 1;
+      }
+    } else
+#endif
     do {
       uint8_t finalbyte = (buf->position == buf->lastused);
       if (iec_data.iecflags & JIFFY_LOAD) {
@@ -432,6 +474,7 @@ static uint8_t iec_talk_handler(uint8_t cmd) {
         if (jiffy_send(buf->data[buf->position],0,128 | !finalbyte)) {
           /* Abort if ATN was seen */
           iec_check_atn();
+          d64_prefetch_cancel();
           return -1;
         }
 
@@ -476,6 +519,12 @@ static uint8_t iec_talk_handler(uint8_t cmd) {
             uart_putc('V');
             return 1;
           }
+
+#if defined(CONFIG_SPARE_BUFFERS) || defined(CONFIG_CHAIN_PREFETCH)
+          /* Read the next block while the listener waits */
+          if (buf->position == 2 && STANDARD_TRANSFER())
+            block_service();
+#endif
         }
       }
     } while (buf->position++ < buf->lastused);
@@ -502,8 +551,10 @@ static uint8_t iec_talk_handler(uint8_t cmd) {
       while (!IEC_DATA && !has_timed_out()) ;
 
       /* check if ATN changed */
-      if (iec_check_atn())
+      if (iec_check_atn()) {
+        d64_prefetch_cancel();
         return -1;
+      }
 
       /* Signal to the C64 that we're ready to send the next block */
       set_data(0);
@@ -548,6 +599,9 @@ void iec_mainloop(void) {
   iec_data.bus_state = BUS_IDLE;
 
   while (1) {
+    /* Drop bytes the engine received for a previous state */
+    iec_engine_stop();
+
     switch (iec_data.bus_state) {
     case BUS_SLEEP:
       set_atn_irq(0);
@@ -582,6 +636,8 @@ void iec_mainloop(void) {
           display_service();
           reset_key(KEY_DISPLAY);
         }
+        d64_prefetch_service();
+        spare_service();
         system_sleep();
       }
 
@@ -66,6 +66,14 @@ static inline void iec_interrupts_init(void) {
 /* P00 name cache is in AHB ram */
 #define P00CACHE_ATTRIB __attribute__((section(".ahbram")))
 
+/* Dxx track cache is in AHB ram */
+#define TRACKCACHE_ATTRIB __attribute__((section(".ahbram")))
+
+/* The part of the AHB ram that is not used by variables is the RAM pool */
+extern uint8_t __ahbram_end__[], __ahbram_limit__[];
+#define RAM_POOL_START __ahbram_end__
+#define RAM_POOL_END   __ahbram_limit__
+
 // FIXME: Add a fully-commented example configuration that
 //        demonstrates all configuration possilibilites
 
@@ -40,4 +40,20 @@ void delay_ms(unsigned int time);
 void start_timeout(unsigned int usecs);
 unsigned int has_timed_out(void);
 
+/* CPU cycle counter in the DWT unit of the Cortex-M3, for benchmarks */
+#define HAVE_CYCLE_COUNTER
+
+#define DWT_CTRL   (*(volatile uint32_t *)0xe0001000)
+#define DWT_CYCCNT (*(volatile uint32_t *)0xe0001004)
+#define DEMCR      (*(volatile uint32_t *)0xe000edfc)
+
+static inline uint32_t cycle_counter(void) {
+  if (!(DWT_CTRL & 1)) {
+    DEMCR    |= 1 << 24; /* TRCENA */
+    DWT_CYCCNT = 0;
+    DWT_CTRL |= 1;       /* CYCCNTENA */
+  }
+  return DWT_CYCCNT;
+}
+
 #endif
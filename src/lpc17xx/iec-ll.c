@@ -0,0 +1,652 @@
+/* sd2iec - SD/MMC to Commodore serial bus interface/controller
+   Copyright (C) 2007-2013  Ingo Korb <ingo@akana.de>
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   iec-ll.c: Interrupt-driven byte transfers of the standard IEC protocol
+
+   This is the byte-level protocol of _iec_getc and iec_putc in iec.c
+   rebuilt as a state machine that is advanced by the capture interrupts
+   of CLOCK and DATA and by match register 3 of the ATN timer for delays.
+   Bytes are passed through a FIFO, so the main loop can work on the card
+   while they are moving. CLOCK and DATA are captured by the same timer
+   on all supported boards.
+
+*/
+
+#include "config.h"
+#include <arm/NXP/LPC17xx/LPC17xx.h>
+#include <arm/bits.h>
+#include "atomic.h"
+#include "buffers.h"
+#include "d64ops.h"
+#include "flags.h"
+#include "iec-bus.h"
+#include "iec.h"
+#include "iec-ll.h"
+
+/* IEC timer ticks per microsecond */
+#define TICKS_US 10
+
+/* match register used for delays, interrupt bit in MCR and IR */
+#define DELAY_TIMER IEC_TIMER_ATN
+#define DELAY_MR    MR3
+#define DELAY_MCRI  9
+#define DELAY_IR    3
+
+/* The delay match register must not drive a bus line. With all outputs */
+/* on timer 2 the ATN timer is the other one and has no outputs at all.  */
+#if !defined(IEC_ALL_MATCHES_ON_TIMER2) && \
+    (IEC_OPIN_ATN == 3 || IEC_OPIN_CLOCK == 3 || IEC_OPIN_DATA == 3 || IEC_OPIN_SRQ == 3)
+#  error "IEC engine: MR3 of the ATN timer drives a bus line"
+#endif
+
+#define FIFO_SIZE 256
+#define FIFO_EOI  0x100
+
+typedef enum {
+  ENG_IDLE = 0,
+
+  /* receive, see _iec_getc (E9C9) */
+  RX_START,          // wait until the talker is ready to send
+  RX_READY,          // release DATA as soon as the FIFO has room
+  RX_RELEASED,       // wait until all devices released DATA
+  RX_LISTEN,         // first bit or EOI timeout
+  RX_EOI,            // EOI acknowledge pulse
+  RX_EOI_END,        // wait for the first bit after EOI
+  RX_BIT_HIGH,       // capture a bit on the rising edge of CLOCK
+  RX_BIT_LOW,        // wait for the end of a bit
+  RX_JIFFY_WINDOW,   // JiffyDOS detection before the last bit under ATN
+  RX_JIFFY_ACK,      // JiffyDOS acknowledge pulse
+  RX_FRAME,          // frame handshake
+  RX_HOLDOFF,        // slow down a little bit before the next byte
+
+  /* send, see iec_putc (E916) */
+  TX_NEXT,           // take the next byte from the FIFO
+  TX_READY,          // release CLOCK to signal ready to send
+  TX_LISTENER,       // wait until the listener is ready for data
+  TX_EOI,            // wait for the EOI acknowledge of the listener
+  TX_START,          // pull CLOCK to start the bits
+  TX_START_WAIT,     // delay before the first bit
+  TX_START_DATA,     // wait for DATA high before the first bit
+  TX_BIT,            // check DATA before each bit
+  TX_BIT_DATA,       // put the bit on DATA
+  TX_BIT_CLOCK,      // release CLOCK for the bit
+  TX_BIT_END,        // pull CLOCK again
+  TX_BIT_RELEASE,    // release DATA after the bit
+  TX_FRAME,          // wait for the frame handshake of the listener
+  TX_HOLDOFF         // wait up to 250us for DATA high
+} engstate_t;
+
+typedef enum { ENG_OK = 0, ENG_ABORT, ENG_ERROR } engresult_t;
+
+static struct {
+  volatile uint8_t  state;
+  volatile uint8_t  result;   // engresult_t of the last transfer
+  volatile uint8_t  timeout;  // delay has passed
+  volatile uint16_t sent;     // bytes acknowledged by the listener
+  uint8_t  atn;               // ATN level at the start of the transfer
+  uint8_t  oneshot;           // receive a single byte under ATN
+  uint8_t  bit;
+  uint8_t  value;
+  uint8_t  eoi;
+  uint8_t  dataseen;          // DATA was high before ready to send
+} eng;
+
+/* byte FIFO between the state machine and the buffers, bit 8 is EOI */
+static struct {
+  uint16_t data[FIFO_SIZE];
+  volatile uint8_t  head;     // next entry written
+  volatile uint8_t  tail;     // next entry read
+  volatile uint16_t count;
+} fifo;
+
+/* ---------- utility functions ---------- */
+
+static void fifo_put(uint16_t entry) {
+  fifo.data[fifo.head++] = entry;
+  fifo.count++;
+}
+
+static void fifo_reset(void) {
+  fifo.head  = 0;
+  fifo.tail  = 0;
+  fifo.count = 0;
+}
+
+/* start a delay, the state machine runs again when it has passed */
+static void start_delay(unsigned int usecs) {
+  eng.timeout = 0;
+  DELAY_TIMER->DELAY_MR = DELAY_TIMER->TC + usecs * TICKS_US;
+  DELAY_TIMER->IR = BV(DELAY_IR);
+  BITBAND(DELAY_TIMER->MCR, DELAY_MCRI) = 1;
+}
+
+static void stop_delay(void) {
+  BITBAND(DELAY_TIMER->MCR, DELAY_MCRI) = 0;
+  eng.timeout = 0;
+}
+
+/* disable the capture edges of CLOCK and DATA, keep their interrupts */
+static void disarm_lines(void) {
+  IEC_TIMER_CLOCK->CCR &= ~(3 << (3 * IEC_CAPTURE_CLOCK));
+  IEC_TIMER_DATA->CCR  &= ~(3 << (3 * IEC_CAPTURE_DATA));
+  IEC_TIMER_CLOCK->IR = BV(4 + IEC_CAPTURE_CLOCK);
+  IEC_TIMER_DATA->IR  = BV(4 + IEC_CAPTURE_DATA);
+}
+
+/**
+ * clock_is - check the level of CLOCK
+ * @level: level to wait for (0 low, 1 high)
+ *
+ * This function enables the capture interrupt for the edge of CLOCK
+ * towards @level and checks if the line is there already. Returns
+ * true and disables the capture edges if it is.
+ */
+static uint8_t clock_is(unsigned int level) {
+  BITBAND(IEC_TIMER_CLOCK->CCR, 3*IEC_CAPTURE_CLOCK + IEC_IN_COND_INV(!level)) = 1;
+  if (!IEC_CLOCK != !level)
+    return 0;
+
+  disarm_lines();
+  return 1;
+}
+
+/* data_is - see clock_is */
+static uint8_t data_is(unsigned int level) {
+  BITBAND(IEC_TIMER_DATA->CCR, 3*IEC_CAPTURE_DATA + IEC_IN_COND_INV(!level)) = 1;
+  if (!IEC_DATA != !level)
+    return 0;
+
+  disarm_lines();
+  return 1;
+}
+
+/**
+ * finish - end the current transfer
+ * @result: engresult_t of the transfer
+ *
+ * This function stops the state machine. If the transfer was aborted
+ * because ATN is active now, CLOCK is released and ATN is acknowledged
+ * with DATA low like the ATN interrupt of a 1541 does. Otherwise the bus
+ * lines are left as they are.
+ */
+static void finish(engresult_t result) {
+  disarm_lines();
+  stop_delay();
+  if (result == ENG_ABORT && !IEC_ATN) {
+    set_clock(1);
+    set_data(0);
+  }
+  eng.result = result;
+  eng.state  = ENG_IDLE;
+}
+
+/* ---------- state machine ---------- */
+
+/**
+ * step - advance the state machine
+ *
+ * This function handles the current state of the transfer. States that
+ * wait for a line level or a delay check it themselves, so spurious
+ * events are harmless. Returns true if the next state should be handled
+ * immediately or false if it waits for an event.
+ */
+static uint8_t step(void) {
+  switch (eng.state) {
+  case RX_START:
+    if (!clock_is(1))
+      return 0;
+    eng.state = RX_READY;
+    return 1;
+
+  case RX_READY:
+    if (fifo.count == FIFO_SIZE)
+      /* continued by iec_engine_getc */
+      return 0;
+
+    eng.value = 0;
+    eng.bit   = 0;
+    eng.eoi   = 0;
+    set_data(1);                                       // E9D7
+    eng.state = RX_RELEASED;
+    return 1;
+
+  case RX_RELEASED:
+    if (!data_is(1))                                   // FF20
+      return 0;
+    /* Timer for EOI detection */
+    start_delay(256);
+    eng.state = RX_LISTEN;
+    return 1;
+
+  case RX_LISTEN:
+    if (clock_is(0)) {
+      stop_delay();
+      eng.state = RX_BIT_HIGH;
+      return 1;
+    }
+    if (!eng.timeout)
+      return 0;
+
+    /* Timeout -> EOI */
+    set_data(0);                                       // E9F2
+    start_delay(73);
+    eng.state = RX_EOI;
+    return 0;
+
+  case RX_EOI:
+    if (!eng.timeout)
+      return 0;
+    set_data(1);
+    eng.eoi   = 1;                                     // EA07
+    eng.state = RX_EOI_END;
+    return 1;
+
+  case RX_EOI_END:
+    if (!clock_is(0))                                  // E9FD
+      return 0;
+    eng.state = RX_BIT_HIGH;
+    return 1;
+
+  case RX_BIT_HIGH:
+    if (!clock_is(1))                                  // EA0B
+      return 0;
+    eng.value = (eng.value >> 1) | (!!IEC_DATA << 7);  // EA18
+    eng.state = RX_BIT_LOW;
+    return 1;
+
+  case RX_BIT_LOW:
+    if (!clock_is(0))                                  // EA1A
+      return 0;
+
+    eng.bit++;
+    if (eng.bit == 8) {
+      start_delay(5);
+      eng.state = RX_FRAME;
+      return 0;
+    }
+
+    if (eng.bit == 7 && eng.oneshot && !(iec_data.iecflags & JIFFY_ACTIVE)) {
+      /* If there is a delay before the last bit, the controller uses JiffyDOS */
+      start_delay(218);
+      eng.state = RX_JIFFY_WINDOW;
+    } else
+      eng.state = RX_BIT_HIGH;
+    return 1;
+
+  case RX_JIFFY_WINDOW:
+    if (clock_is(1)) {
+      stop_delay();
+      eng.state = RX_BIT_HIGH;
+      return 1;
+    }
+    if (!eng.timeout)
+      return 0;
+
+    if ((eng.value>>1) < 0x60 && ((eng.value>>1) & 0x1f) == device_address) {
+      /* If it's for us, notify controller that we support Jiffy too */
+      set_data(0);
+      start_delay(101);
+      eng.state = RX_JIFFY_ACK;
+      return 0;
+    }
+    eng.state = RX_BIT_HIGH;
+    return 1;
+
+  case RX_JIFFY_ACK:
+    if (!eng.timeout)
+      return 0;
+    set_data(1);
+    iec_data.iecflags |= JIFFY_ACTIVE;
+    eng.state = RX_BIT_HIGH;
+    return 1;
+
+  case RX_FRAME:
+    if (!eng.timeout)
+      return 0;
+    set_data(0);                                       // EA28
+    fifo_put(eng.value | (eng.eoi ? FIFO_EOI : 0));
+    /* Slow down a little bit, may or may not fix some problems */
+    start_delay(50);
+    eng.state = RX_HOLDOFF;
+    return 0;
+
+  case RX_HOLDOFF:
+    if (!eng.timeout)
+      return 0;
+    if (eng.oneshot) {
+      finish(ENG_OK);
+      return 0;
+    }
+    eng.state = RX_START;
+    return 1;
+
+  case TX_NEXT:
+    if (fifo.count == 0) {
+      finish(ENG_OK);
+      return 0;
+    }
+    eng.value    = fifo.data[fifo.tail];
+    eng.eoi      = !!(fifo.data[fifo.tail] & FIFO_EOI);
+    eng.dataseen = IEC_DATA;
+    fifo.tail++;
+    fifo.count--;
+
+    start_delay(60); // Fudged delay
+    eng.state = TX_READY;
+    return 0;
+
+  case TX_READY:
+    if (!eng.timeout)
+      return 0;
+    set_clock(1);
+    eng.state = TX_LISTENER;
+    return 1;
+
+  case TX_LISTENER:
+    if (!data_is(1))                                   // E925
+      return 0;
+    if (eng.eoi || eng.dataseen)
+      eng.state = TX_EOI;
+    else
+      eng.state = TX_START;
+    return 1;
+
+  case TX_EOI:
+    if (!data_is(0))                                   // E941
+      return 0;
+    eng.state = TX_START;
+    return 1;
+
+  case TX_START:
+    set_clock(0);                                      // E94B
+    start_delay(40); // estimated
+    eng.state = TX_START_WAIT;
+    return 0;
+
+  case TX_START_WAIT:
+    if (!eng.timeout)
+      return 0;
+    eng.state = TX_START_DATA;
+    return 1;
+
+  case TX_START_DATA:
+    if (!data_is(1))
+      return 0;
+    eng.bit = 0;
+    start_delay(21); // calculated - E951 (best case after bus read) - E95B
+    eng.state = TX_BIT;
+    return 0;
+
+  case TX_BIT:
+    if (!eng.timeout)
+      return 0;
+    if (eng.bit == 8) {
+      eng.state = TX_FRAME;
+      return 1;
+    }
+    if (!IEC_DATA) {                                   // E95C
+      finish(ENG_ERROR);
+      return 0;
+    }
+    start_delay(45); // calculated
+    eng.state = TX_BIT_DATA;
+    return 0;
+
+  case TX_BIT_DATA:
+    if (!eng.timeout)
+      return 0;
+    set_data(eng.value & 1<<eng.bit);
+    start_delay(22); // calculated
+    eng.state = TX_BIT_CLOCK;
+    return 0;
+
+  case TX_BIT_CLOCK:
+    if (!eng.timeout)
+      return 0;
+    set_clock(1);
+    if (globalflags & VC20MODE)
+      start_delay(34);
+    else
+      start_delay(75);
+    eng.state = TX_BIT_END;
+    return 0;
+
+  case TX_BIT_END:
+    if (!eng.timeout)
+      return 0;
+    set_clock(0);                                      // FEFB
+    start_delay(22); // calculated
+    eng.state = TX_BIT_RELEASE;
+    return 0;
+
+  case TX_BIT_RELEASE:
+    if (!eng.timeout)
+      return 0;
+    set_data(1);                                       // FEFE
+    eng.bit++;
+    start_delay(14); // Settle time, approximate
+    eng.state = TX_BIT;
+    return 0;
+
+  case TX_FRAME:
+    if (!data_is(0))
+      return 0;
+    eng.sent++;
+    /* Wait for 250us or until DATA is high, see iec_putc */
+    start_delay(250);
+    eng.state = TX_HOLDOFF;
+    return 1;
+
+  case TX_HOLDOFF:
+    if (!data_is(1) && !eng.timeout)
+      return 0;
+    disarm_lines();
+    stop_delay();
+    eng.state = TX_NEXT;
+    return 1;
+
+  default:
+    finish(ENG_ERROR);
+    return 0;
+  }
+}
+
+/* run the state machine until it waits, aborts if ATN has changed */
+static void run(void) {
+  if (eng.state == ENG_IDLE)
+    return;
+
+  if (!IEC_ATN != !eng.atn) {
+    finish(ENG_ABORT);
+    return;
+  }
+
+  while (step()) ;
+}
+
+/* start a transfer in the given state, ATN aborts it from its interrupt */
+static void start(engstate_t state) {
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    set_atn_irq(1);
+    eng.atn     = IEC_ATN;
+    eng.result  = ENG_OK;
+    eng.timeout = 0;
+    eng.bit     = 0;
+    eng.state   = state;
+    run();
+  }
+}
+
+/* ---------- interrupt handlers ---------- */
+
+/**
+ * iec_engine_irq - handle the IEC timer interrupts
+ *
+ * This function is called from the interrupt handlers of both IEC
+ * timers. It clears the CLOCK/DATA capture and delay events of a running
+ * transfer and advances its state machine.
+ */
+void iec_engine_irq(void) {
+  uint32_t events;
+  uint8_t  delay = 0;
+
+  if (eng.state == ENG_IDLE)
+    return;
+
+  events = IEC_TIMER_CLOCK->IR &
+    (BV(4 + IEC_CAPTURE_CLOCK) | BV(4 + IEC_CAPTURE_DATA));
+  if (events)
+    IEC_TIMER_CLOCK->IR = events;
+
+  if (BITBAND(DELAY_TIMER->IR, DELAY_IR) &&
+      BITBAND(DELAY_TIMER->MCR, DELAY_MCRI)) {
+    DELAY_TIMER->IR = BV(DELAY_IR);
+    BITBAND(DELAY_TIMER->MCR, DELAY_MCRI) = 0;
+    eng.timeout = 1;
+    delay = 1;
+  }
+
+  if (events || delay)
+    run();
+}
+
+/**
+ * iec_engine_atn - abort a transfer when ATN changes
+ *
+ * This function is called from the ATN interrupt handler, which is
+ * enabled while the engine runs. A transfer stops at once when ATN has
+ * changed since its start and ATN is acknowledged, see finish.
+ */
+void iec_engine_atn(void) {
+  if (eng.state != ENG_IDLE && !IEC_ATN != !eng.atn)
+    finish(ENG_ABORT);
+}
+
+/* ---------- interface to the bus layer ---------- */
+
+/**
+ * iec_engine_stop - stop the current transfer
+ *
+ * This function stops a running transfer and drops bytes that were
+ * received but not read yet. The bus lines are left as they are.
+ */
+void iec_engine_stop(void) {
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    if (eng.state != ENG_IDLE)
+      finish(ENG_ABORT);
+    fifo_reset();
+  }
+}
+
+/**
+ * iec_engine_getc - receive one byte from the CBM serial bus
+ *
+ * This function returns the next byte received from the bus. Under ATN
+ * every byte is received separately, otherwise the engine keeps receiving
+ * into the FIFO and the bus is idle-serviced while there is no byte.
+ * Returns -1 if the device state has changed, the caller should return
+ * to the main loop immediately in that case.
+ */
+int16_t iec_engine_getc(void) {
+  uint16_t entry;
+
+  while (fifo.count == 0) {
+    if (iec_check_atn()) {
+      iec_engine_stop();
+      return -1;
+    }
+
+    if (eng.state == ENG_IDLE) {
+      eng.oneshot = (iec_data.bus_state == BUS_ATNACTIVE);
+      start(RX_START);
+    }
+
+    if (!eng.oneshot) {
+      d64_prefetch_service();
+      spare_service();
+    }
+  }
+
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    entry = fifo.data[fifo.tail++];
+    fifo.count--;
+
+    /* continue a receive that waits for room in the FIFO */
+    if (eng.state == RX_READY)
+      run();
+  }
+
+  if (entry & FIFO_EOI)
+    iec_data.iecflags |= EOI_RECVD;
+
+  return entry & 0xff;
+}
+
+/**
+ * iec_engine_send - send the rest of a buffer over the serial bus
+ * @buf: buffer to be sent
+ *
+ * This function sends the bytes from the current position to lastused of
+ * @buf, the last one with EOI if sendeoi is set. The bytes are copied to
+ * the FIFO, so the disk image prefetch and the second data areas are
+ * serviced while they are sent. On success the position is set behind lastused
+ * like the byte loop in iec.c does, otherwise to the first byte that was
+ * not acknowledged. Returns 0 normally or 1 if the bus state has changed,
+ * the caller should return to the main loop in that case.
+ */
+uint8_t iec_engine_send(buffer_t *buf) {
+  uint8_t pos = buf->position;
+
+  if (iec_check_atn())
+    return 1;
+
+  iec_engine_stop();
+
+  do {
+    if (pos == buf->lastused && buf->sendeoi)
+      fifo_put(buf->data[pos] | FIFO_EOI);
+    else
+      fifo_put(buf->data[pos]);
+  } while (pos++ < buf->lastused);
+
+  eng.sent = 0;
+  start(TX_NEXT);
+
+  /* Read the next block while this one is sent */
+  while (eng.state != ENG_IDLE) {
+    d64_prefetch_service();
+    spare_service();
+  }
+
+  if (eng.result != ENG_OK) {
+    buf->position += eng.sent;
+    fifo_reset();
+
+    if (eng.result == ENG_ERROR)
+      iec_data.bus_state = BUS_CLEANUP;
+    else
+      iec_check_atn();
+    return 1;
+  }
+
+  buf->position = buf->lastused + 1;
+  return 0;
+}
@@ -26,6 +26,7 @@
 #include "config.h"
 #include <arm/NXP/LPC17xx/LPC17xx.h>
 #include <arm/bits.h>
+#include "iec-ll.h"
 #include "system.h"
 
 
@@ -136,9 +137,14 @@ void IEC_TIMER_A_HANDLER(void) {
     if (BITBAND(IEC_TIMER_ATN->IR, 4 + IEC_CAPTURE_ATN)) {
       IEC_TIMER_ATN->IR = 1 << (4 + IEC_CAPTURE_ATN);
       iec_atn_handler();
+      iec_engine_atn();
     }
   }
 
+#ifdef CONFIG_IEC_ENGINE
+  iec_engine_irq();
+#endif
+
 #ifdef CONFIG_LOADER_DREAMLOAD
   if (IEC_TIMER_CLOCK == IEC_TIMER_A) {
     if (BITBAND(IEC_TIMER_CLOCK->IR, 4 + IEC_CAPTURE_CLOCK)) {
@@ -154,9 +160,14 @@ void IEC_TIMER_B_HANDLER(void) {
     if (BITBAND(IEC_TIMER_ATN->IR, 4 + IEC_CAPTURE_ATN)) {
       IEC_TIMER_ATN->IR = 1 << (4 + IEC_CAPTURE_ATN);
       iec_atn_handler();
+      iec_engine_atn();
     }
   }
 
+#ifdef CONFIG_IEC_ENGINE
+  iec_engine_irq();
+#endif
+
 #ifdef CONFIG_LOADER_DREAMLOAD
   if (IEC_TIMER_CLOCK == IEC_TIMER_B) {
     if (BITBAND(IEC_TIMER_CLOCK->IR, 4 + IEC_CAPTURE_CLOCK)) {
@@ -280,7 +280,7 @@ static void m2i_open_write(path_t *path, cbmdirent_t *dent, uint8_t type, buffer
   FRESULT res;
 
   /* Check for read-only image file */
-  if (!(partition[path->part].imagehandle.flag & FA_WRITE)) {
+  if (!(image_handle(path->part)->flag & FA_WRITE)) {
     set_error(ERROR_WRITE_PROTECT);
     return;
   }
@@ -27,6 +27,7 @@
 #include <stdint.h>
 #include <string.h>
 #include "config.h"
+#include "d64ops.h"
 #include "dirent.h"
 #include "display.h"
 #include "errormsg.h"
@@ -35,7 +36,7 @@
 #include "ustring.h"
 #include "parser.h"
 
-partition_t partition[CONFIG_MAX_PARTITIONS];
+partition_t partition[PARTITION_COUNT];
 uint8_t current_part;
 uint8_t max_part;
 uint8_t dir_changed;
@@ -194,8 +195,18 @@ uint8_t match_name(uint8_t *matchstr, cbmdirent_t *dent, uint8_t ignorecase) {
  */
 int8_t next_match(dh_t *dh, uint8_t *matchstr, date_t *start, date_t *end, uint8_t type, cbmdirent_t *dent) {
   int8_t res;
+#ifdef CONFIG_DIR_INDEX
+  uint8_t use_index = matchstr && partition[dh->part].fop == &d64ops &&
+                      !ustrchr(matchstr, '*') && !ustrchr(matchstr, '?');
+#endif
 
   while (1) {
+#ifdef CONFIG_DIR_INDEX
+    /* disk images: skip entries whose name cannot match */
+    if (use_index)
+      d64_find_name(dh, matchstr);
+#endif
+
     res = readdir(dh, dent);
     if (res == 0) {
       /* Skip if the type doesn't match */
@@ -333,14 +344,19 @@ uint8_t parse_path(uint8_t *in, path_t *path, uint8_t **name, uint8_t parse_alwa
           }
 
           if ((dent.typeflags & TYPE_MASK) != TYPE_DIR) {
+#ifdef CONFIG_IMAGE_SLOTS
+            /* Not a directory, access disk images like one */
+            if (image_slot_mount(path, &dent))
+              return 1;
+#else
             /* Not a directory */
-            /* FIXME: Try to mount as image here so they can be accessed like a directory */
             set_error(ERROR_FILE_NOT_FOUND_39);
             return 1;
-          }
+#endif
+          } else
+            /* Match found, move path */
+            chdir(path, &dent);
 
-          /* Match found, move path */
-          chdir(path, &dent);
           *end = saved;
           in = end;
           break;
@@ -29,7 +29,24 @@
 #include "dirent.h"
 #include "ff.h"
 
-extern partition_t partition[CONFIG_MAX_PARTITIONS];
+#ifdef CONFIG_IMAGE_SLOTS
+/* Partitions for disk images that are mounted as part of a path */
+#  define FIRST_IMAGE_SLOT CONFIG_MAX_PARTITIONS
+#  define PARTITION_COUNT  (CONFIG_MAX_PARTITIONS + CONFIG_IMAGE_SLOTS)
+#  define is_image_slot(part) ((part) >= FIRST_IMAGE_SLOT && (part) < PARTITION_COUNT)
+#else
+#  define PARTITION_COUNT  CONFIG_MAX_PARTITIONS
+#  define is_image_slot(part) 0
+#endif
+
+extern partition_t partition[PARTITION_COUNT];
+
+/* File handle of the image mounted on a partition */
+#ifdef CONFIG_IMAGE_HANDLES
+#  define image_handle(part) (partition[part].imagehandle)
+#else
+#  define image_handle(part) (&partition[part].imagehandle)
+#endif
 extern uint8_t current_part;
 extern uint8_t max_part;
 
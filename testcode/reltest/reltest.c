@@ -21,16 +21,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 
 /* Add a workaround for a 1541 rom bug that occasionally writes data */
 /* into the wrong sector if the record spans more than one sector.   */
 /* #define SEEK_TWICE */
 
+/* Mount a disk image before testing to exercise the Dxx REL code */
+/* #define TEST_IMAGE "reltest.d81" */
+
 /* Static for now */
 #define RECORD_LENGTH 47
 #define TESTFILE_NAME "reltest"
 #define TEST_RECORDS 258
 
+/* Number of records used for the throughput benchmark */
+#define BENCH_RECORDS 500
+
 unsigned char buffer[256];
 unsigned char errorbuffer[128];
 unsigned char reference[256];
@@ -372,16 +379,80 @@ void run_tests(unsigned char record_length) {
     return;
 }
 
+/* Print the number of records per second for a benchmark pass */
+void print_rate(clock_t ticks, unsigned int records) {
+  unsigned long rate;
+
+  if (ticks == 0)
+    ticks = 1;
+
+  rate = (unsigned long)records * CLOCKS_PER_SEC / ticks;
+  gotox(35);
+  printf("%lu/s\n", rate);
+}
+
+/* Measure record throughput: sequential writes and positioned reads */
+void run_benchmark(unsigned char record_length) {
+  unsigned int i, record;
+  unsigned char j;
+  clock_t start;
+
+  /* Create all records first so the write pass doesn't time expansion */
+  rel_seek(BENCH_RECORDS, 1);
+  buffer[0] = 0xff;
+  cbm_write(1, buffer, 1);
+  if (expect_error("expand", 50))
+    return;
+
+  printf("Sequential writes...");
+  rel_seek(1, 1);
+  start = clock();
+  for (i=1; i<=BENCH_RECORDS; ++i) {
+    for (j=0; j<record_length; ++j)
+      buffer[j] = data_function(record_length, i, j, 0);
+
+    cbm_write(1, buffer, record_length);
+  }
+  print_rate(clock() - start, BENCH_RECORDS);
+
+  if (expect_error("write", 0))
+    return;
+
+  /* Step through the file with a stride that is coprime to */
+  /* the record count to force a P command for every record */
+  printf("Positioned reads...");
+  record = 0;
+  start = clock();
+  for (i=0; i<BENCH_RECORDS; ++i) {
+    record = (record + 263) % BENCH_RECORDS;
+    rel_seek(record + 1, 1);
+    size = cbm_read(1, buffer, sizeof(buffer));
+  }
+  print_rate(clock() - start, BENCH_RECORDS);
+
+  expect_error("read", 0);
+}
+
 int main(void) {
   clrscr();
   textcolor(COLOR_WHITE);
-  puts("REL-Test 0.1\n");
+  puts("REL-Test 0.2\n");
 
   cbm_open(15,8,15,"ui");
   size = cbm_read(15, buffer, sizeof(buffer));
   buffer[size] = 0;
   printf("Drive: %s\n", buffer);
 
+#ifdef TEST_IMAGE
+  /* Change into the disk image */
+  strcpy(buffer, "cd:" TEST_IMAGE);
+  cbm_write(15,buffer,strlen(buffer));
+  if (expect_error("cd", 0)) {
+    cbm_close(15);
+    return 1;
+  }
+#endif
+
   /* Delete test file */
   strcpy(buffer, "s:" TESTFILE_NAME);
   cbm_write(15,buffer,strlen(buffer));
@@ -397,8 +468,10 @@ int main(void) {
   message_ok();
 
   /* Run tests */
-  if (!expect_error("open", 0))
+  if (!expect_error("open", 0)) {
     run_tests(RECORD_LENGTH);
+    run_benchmark(RECORD_LENGTH);
+  }
 
   cbm_close(1);
   cbm_close(15);